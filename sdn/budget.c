@@ -0,0 +1,215 @@
+/*
+ *	BIRD -- SDN Flow Table Budget
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Flow table budget
+ *
+ * Switches hold far fewer flow entries than an Internet routing table
+ * has prefixes, so the protocol can be told to send the controller just
+ * the @limit best ranked routes. The routes are kept in two binary
+ * heaps: the exported ones with the worst on top, the rest with the
+ * best on top. When a route comes, goes or changes its rank, it is put
+ * to, taken from or moved within its heap, and as long as the top of
+ * the second heap ranks better than the top of the first one, the two
+ * change places. Each change of a route thus costs O(log n) and moves at
+ * most a route or two in or out of the exported set, which is exactly
+ * what the controller has to be told.
+ *
+ * Entries remember their position in the heap in @slot, so any of them
+ * can be taken out or moved, and their heap in the %SEF_RANKED and
+ * %SEF_BUDGET flags. Ties are never broken by swapping, so routes of
+ * the same rank do not take turns in the flow table.
+ */
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "lib/resource.h"
+
+#include "sdn.h"
+
+#define SDN_HEAP_MIN	1024
+
+/* Whether @a belongs nearer the top than @b */
+static inline int
+sdn_heap_above(struct sdn_heap *h, u32 a, u32 b)
+{
+  return h->max ? (a > b) : (a < b);
+}
+
+static inline void
+sdn_heap_put(struct sdn_heap *h, u32 i, struct sdn_heap_item it)
+{
+  h->item[i] = it;
+  it.e->slot = i;
+}
+
+static void
+sdn_heap_up(struct sdn_heap *h, u32 i)
+{
+  struct sdn_heap_item it = h->item[i];
+  u32 up;
+
+  for (; i; i = up)
+    {
+      up = (i - 1) / 2;
+      if (!sdn_heap_above(h, it.rank, h->item[up].rank))
+	break;
+      sdn_heap_put(h, i, h->item[up]);
+    }
+  sdn_heap_put(h, i, it);
+}
+
+static void
+sdn_heap_down(struct sdn_heap *h, u32 i)
+{
+  struct sdn_heap_item it = h->item[i];
+  u32 down;
+
+  while ((down = 2 * i + 1) < h->count)
+    {
+      if ((down + 1 < h->count) && sdn_heap_above(h, h->item[down + 1].rank, h->item[down].rank))
+	down++;
+      if (!sdn_heap_above(h, h->item[down].rank, it.rank))
+	break;
+      sdn_heap_put(h, i, h->item[down]);
+      i = down;
+    }
+  sdn_heap_put(h, i, it);
+}
+
+static void
+sdn_heap_push(struct sdn_budget *b, struct sdn_heap *h, struct sdn_entry *e, u32 rank)
+{
+  struct sdn_heap_item it = { e, rank };
+
+  if (h->count == h->size)
+    {
+      h->size = MAX(2 * h->size, SDN_HEAP_MIN);
+      h->item = h->item ? mb_realloc(h->item, h->size * sizeof(struct sdn_heap_item)) :
+			  mb_alloc(b->pool, h->size * sizeof(struct sdn_heap_item));
+    }
+
+  sdn_heap_put(h, h->count, it);
+  sdn_heap_up(h, h->count++);
+}
+
+static struct sdn_heap_item
+sdn_heap_delete(struct sdn_heap *h, u32 i)
+{
+  struct sdn_heap_item it = h->item[i], last;
+
+  if (i != --h->count)
+    {
+      last = h->item[h->count];
+      sdn_heap_put(h, i, last);
+      sdn_heap_up(h, i);
+      sdn_heap_down(h, last.e->slot);
+    }
+  return it;
+}
+
+/* Move the top of one heap to the other one */
+static void
+sdn_budget_move(struct sdn_budget *b, int in)
+{
+  struct sdn_heap *from = in ? &b->out : &b->in;
+  struct sdn_heap *to = in ? &b->in : &b->out;
+  struct sdn_heap_item it = sdn_heap_delete(from, 0);
+
+  sdn_heap_push(b, to, it.e, it.rank);
+  if (in)
+    it.e->n.flags |= SEF_BUDGET;
+  else
+    it.e->n.flags &= ~SEF_BUDGET;
+
+  b->moves++;
+  b->moved(b, it.e, in);
+}
+
+static void
+sdn_budget_balance(struct sdn_budget *b)
+{
+  while (b->in.count > b->limit)
+    sdn_budget_move(b, 0);
+
+  while ((b->in.count < b->limit) && b->out.count)
+    sdn_budget_move(b, 1);
+
+  while (b->in.count && b->out.count && (b->out.item[0].rank > b->in.item[0].rank))
+    {
+      sdn_budget_move(b, 0);
+      sdn_budget_move(b, 1);
+    }
+}
+
+/**
+ * sdn_budget_init - set up a flow table budget
+ * @b: the budget
+ * @pool: pool to allocate the heaps from
+ * @limit: routes to export
+ *
+ * The @moved hook and @data are to be filled in by the caller.
+ */
+void
+sdn_budget_init(struct sdn_budget *b, pool *pool, u32 limit)
+{
+  memset(b, 0, sizeof(struct sdn_budget));
+  b->pool = pool;
+  b->limit = limit;
+  b->out.max = 1;
+}
+
+/**
+ * sdn_budget_set - rank a route
+ * @b: the budget
+ * @e: its shadow table entry
+ * @rank: the higher, the better
+ *
+ * Puts @e among the routes competing for the budget if it is not there
+ * yet. The @moved hook is called for every entry which enters or leaves
+ * the exported set as a result, @e included.
+ */
+void
+sdn_budget_set(struct sdn_budget *b, struct sdn_entry *e, u32 rank)
+{
+  struct sdn_heap *h = (e->n.flags & SEF_BUDGET) ? &b->in : &b->out;
+  u32 old;
+
+  if (!(e->n.flags & SEF_RANKED))
+    {
+      sdn_heap_push(b, h, e, rank);
+      e->n.flags |= SEF_RANKED;
+    }
+  else if ((old = h->item[e->slot].rank) != rank)
+    {
+      h->item[e->slot].rank = rank;
+      if (sdn_heap_above(h, rank, old))
+	sdn_heap_up(h, e->slot);
+      else
+	sdn_heap_down(h, e->slot);
+    }
+
+  sdn_budget_balance(b);
+}
+
+/**
+ * sdn_budget_remove - take a route out of the competition
+ * @b: the budget
+ * @e: its shadow table entry
+ *
+ * The @moved hook is not called for @e, just for the route taking its
+ * place if @e was exported.
+ */
+void
+sdn_budget_remove(struct sdn_budget *b, struct sdn_entry *e)
+{
+  if (!(e->n.flags & SEF_RANKED))
+    return;
+
+  sdn_heap_delete((e->n.flags & SEF_BUDGET) ? &b->in : &b->out, e->slot);
+  e->n.flags &= ~(SEF_RANKED | SEF_BUDGET);
+  sdn_budget_balance(b);
+}
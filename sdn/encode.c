@@ -0,0 +1,354 @@
+/*
+ *	BIRD -- SDN Record Encoder
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Record encoder
+ *
+ * Every route the SDN protocol sends out is a small JSON record, and a
+ * dump consists of little else. Formatting them with bsprintf() means
+ * parsing the format string again for each record and printing every
+ * address through the generic ip_ntop(). The encoder here writes the
+ * records directly instead. Numbers are emitted two digits at a time
+ * from a table. An IPv4 address takes four lookups in a table of
+ * rendered octets; an IPv6 address is rendered hextet by hextet from a
+ * table of hex digit pairs, compressing the longest run of zeros just
+ * like ip_ntop() does. Which of the two address encoders is compiled in
+ * depends on %IPV6.
+ *
+ * The output is byte for byte the same as that of bsprintf() with %I.
+ * The encoders store a few bytes past the end of what they emit, so the
+ * buffer must have %SDN_ENCODE_SLACK bytes to spare. When the protocol
+ * first starts, sdn_encode_init() checks whole records against
+ * bsprintf() on a sample of addresses, and that nothing is stored past
+ * the slack.
+ */
+
+#include "nest/bird.h"
+#include "lib/string.h"
+
+#include "sdn.h"
+
+static char sdn_dec2[200];		/* "00" to "99" */
+
+#ifndef IPV6
+static struct {
+  char c[4];
+  u32 len;
+} sdn_octet[256];			/* "0" to "255" */
+#else
+static char sdn_hex2[512];		/* "00" to "ff" */
+#endif
+
+static int sdn_encode_ready;
+
+/**
+ * sdn_put_uint - encode an unsigned number
+ * @buf: where to put it
+ * @v: the number
+ *
+ * Returns the end of the output.
+ */
+char *
+sdn_put_uint(char *buf, u64 v)
+{
+  char tmp[20], *t = tmp + sizeof(tmp);
+  int len;
+
+  while (v >= 100)
+    {
+      u64 q = v / 100;
+      t -= 2;
+      memcpy(t, sdn_dec2 + 2 * (v - 100 * q), 2);
+      v = q;
+    }
+  t -= 2;
+  memcpy(t, sdn_dec2 + 2 * v, 2);
+  t += (v < 10);
+
+  len = tmp + sizeof(tmp) - t;
+  memcpy(buf, t, len);
+  return buf + len;
+}
+
+#ifndef IPV6
+
+static inline char *
+sdn_put_octet(char *buf, u32 o)
+{
+  memcpy(buf, sdn_octet[o].c, 4);
+  return buf + sdn_octet[o].len;
+}
+
+/**
+ * sdn_put_ip - encode an address
+ * @buf: where to put it
+ * @a: the address
+ *
+ * Returns the end of the output.
+ */
+char *
+sdn_put_ip(char *buf, ip_addr a)
+{
+  u32 x = ipa_to_u32(a);
+
+  buf = sdn_put_octet(buf, x >> 24);
+  *buf++ = '.';
+  buf = sdn_put_octet(buf, (x >> 16) & 0xff);
+  *buf++ = '.';
+  buf = sdn_put_octet(buf, (x >> 8) & 0xff);
+  *buf++ = '.';
+  return sdn_put_octet(buf, x & 0xff);
+}
+
+#else
+
+static inline char *
+sdn_put_hextet(char *buf, u32 w)
+{
+  char tmp[4];
+  int len = 1 + (w > 0xf) + (w > 0xff) + (w > 0xfff);
+
+  memcpy(tmp, sdn_hex2 + 2 * (w >> 8), 2);
+  memcpy(tmp + 2, sdn_hex2 + 2 * (w & 0xff), 2);
+  memcpy(buf, tmp + 4 - len, len);
+  return buf + len;
+}
+
+char *
+sdn_put_ip(char *buf, ip_addr a)
+{
+  u32 w[8];
+  int bestpos = 0, bestlen = 0, curpos = 0, curlen = 0, i;
+
+  /* Find the longest run of zeros, the first one of the longest ones */
+  for (i = 0; i < 8; i++)
+    {
+      w[i] = (a.addr[i / 2] >> ((i % 2) ? 0 : 16)) & 0xffff;
+      if (w[i])
+	curlen = 0;
+      else
+	{
+	  if (!curlen)
+	    curpos = i;
+	  if (++curlen > bestlen)
+	    bestpos = curpos, bestlen = curlen;
+	}
+    }
+  if (bestlen < 2)
+    bestpos = -1;
+
+  /* IPv4-compatible and IPv4-mapped addresses */
+  if (!bestpos && ((bestlen == 6) || ((bestlen == 5) && (a.addr[2] == 0xffff))))
+    {
+      u32 x = a.addr[3];
+
+      memcpy(buf, "::ffff:", 7);
+      buf += a.addr[2] ? 7 : 2;
+      buf = sdn_put_uint(buf, x >> 24);
+      *buf++ = '.';
+      buf = sdn_put_uint(buf, (x >> 16) & 0xff);
+      *buf++ = '.';
+      buf = sdn_put_uint(buf, (x >> 8) & 0xff);
+      *buf++ = '.';
+      return sdn_put_uint(buf, x & 0xff);
+    }
+
+  for (i = 0; i < 8; i++)
+    if (i == bestpos)
+      {
+	i += bestlen - 1;
+	*buf++ = ':';
+	if (i == 7)
+	  *buf++ = ':';
+      }
+    else
+      {
+	if (i)
+	  *buf++ = ':';
+	buf = sdn_put_hextet(buf, w[i]);
+      }
+  return buf;
+}
+
+#endif
+
+static inline char *
+sdn_put_head(char *buf, u32 table, ip_addr prefix, int pxlen)
+{
+  buf = SDN_PUT(buf, "{\"table\" : ");
+  buf = sdn_put_uint(buf, table);
+  buf = SDN_PUT(buf, ", \"prefix\" : \"");
+  buf = sdn_put_ip(buf, prefix);
+  buf = SDN_PUT(buf, "\", \"mask\" : ");
+  return sdn_put_uint(buf, pxlen);
+}
+
+/**
+ * sdn_put_route - encode a route record
+ * @buf: where to put it
+ * @table: table ID
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @via: next hop, NULL to leave it out
+ *
+ * Writes {"table" : @table, "prefix" : "@prefix", "mask" : @pxlen,
+ * "via" : "@via"}, the same as the %I formats did. Returns the end of
+ * the output.
+ */
+char *
+sdn_put_route(char *buf, u32 table, ip_addr prefix, int pxlen, ip_addr *via)
+{
+  buf = sdn_put_head(buf, table, prefix, pxlen);
+  if (via)
+    {
+      buf = SDN_PUT(buf, ", \"via\" : \"");
+      buf = sdn_put_ip(buf, *via);
+      *buf++ = '"';
+    }
+  *buf++ = '}';
+  return buf;
+}
+
+/**
+ * sdn_put_route_group - encode a multipath route record
+ * @buf: where to put it
+ * @table: table ID
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @group: its next hop group
+ *
+ * Writes {"table" : @table, "prefix" : "@prefix", "mask" : @pxlen,
+ * "group" : @group}. Returns the end of the output.
+ */
+char *
+sdn_put_route_group(char *buf, u32 table, ip_addr prefix, int pxlen, u32 group)
+{
+  buf = sdn_put_head(buf, table, prefix, pxlen);
+  buf = SDN_PUT(buf, ", \"group\" : ");
+  buf = sdn_put_uint(buf, group);
+  *buf++ = '}';
+  return buf;
+}
+
+/**
+ * sdn_put_group - encode a next hop group
+ * @buf: where to put it, at least SDN_GROUP_SIZE() bytes
+ * @id: group number
+ * @g: the group
+ *
+ * Writes {"group" : @id, "nexthops" : [{"via" : "A", "weight" : W},
+ * ...]}. Returns the end of the output.
+ */
+char *
+sdn_put_group(char *buf, u32 id, struct sdn_group *g)
+{
+  int i;
+
+  buf = SDN_PUT(buf, "{\"group\" : ");
+  buf = sdn_put_uint(buf, id);
+  buf = SDN_PUT(buf, ", \"nexthops\" : [");
+  for (i = 0; i < g->count; i++)
+    {
+      if (i)
+	buf = SDN_PUT(buf, ", ");
+      buf = SDN_PUT(buf, "{\"via\" : \"");
+      buf = sdn_put_ip(buf, g->hop[i].gw);
+      buf = SDN_PUT(buf, "\", \"weight\" : ");
+      buf = sdn_put_uint(buf, g->hop[i].weight);
+      *buf++ = '}';
+    }
+  *buf++ = ']';
+  *buf++ = '}';
+  return buf;
+}
+
+#define SDN_CHECK_SIZE	(2 * STD_ADDRESS_P_LENGTH + 64)
+
+/* Encode a route to @a via @a both ways and compare */
+static void
+sdn_encode_check(u32 table, ip_addr a, int pxlen)
+{
+  char want[SDN_CHECK_SIZE], got[SDN_CHECK_SIZE + 2 * SDN_ENCODE_SLACK];
+  char *end;
+  int len, i, ok;
+
+  len = bsprintf(want, "{\"table\" : %u, \"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}",
+		 table, a, pxlen, a);
+  memset(got, '#', sizeof(got));
+  end = sdn_put_route(got, table, a, pxlen, &a);
+  ok = (end - got == len) && !memcmp(want, got, len);
+  for (i = len + SDN_ENCODE_SLACK; ok && (i < (int) sizeof(got)); i++)
+    ok = (got[i] == '#');
+  *end = 0;
+  if (!ok)
+    bug("SDN record encoder gives %s instead of %s", got, want);
+}
+
+/**
+ * sdn_encode_init - set up the encoder tables
+ *
+ * Also checks records of the encoder against bsprintf() once: the
+ * extreme tables, masks and addresses, and a sample of others, with zero
+ * runs of all lengths at all positions for IPv6.
+ */
+void
+sdn_encode_init(void)
+{
+  u32 i, seed = 1;
+#ifdef IPV6
+  u32 w[8], j, k, m;
+#endif
+
+  if (sdn_encode_ready)
+    return;
+
+  for (i = 0; i < 100; i++)
+    {
+      sdn_dec2[2*i] = '0' + i / 10;
+      sdn_dec2[2*i+1] = '0' + i % 10;
+    }
+
+#ifndef IPV6
+  for (i = 0; i < 256; i++)
+    sdn_octet[i].len = bsprintf(sdn_octet[i].c, "%d", i);
+#else
+  for (i = 0; i < 256; i++)
+    {
+      sdn_hex2[2*i] = "0123456789abcdef"[i >> 4];
+      sdn_hex2[2*i+1] = "0123456789abcdef"[i & 15];
+    }
+#endif
+  sdn_encode_ready = 1;
+
+  sdn_encode_check(0, IPA_NONE, 0);
+#ifndef IPV6
+  sdn_encode_check(~0U, ipa_from_u32(~0U), BITS_PER_IP_ADDRESS);
+  for (i = 0; i < 256; i++)
+    sdn_encode_check(i, ipa_from_u32(i * 0x01010101), i % (BITS_PER_IP_ADDRESS + 1));
+  for (i = 0; i < 4096; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      sdn_encode_check(seed, ipa_from_u32(seed), seed % (BITS_PER_IP_ADDRESS + 1));
+    }
+#else
+  sdn_encode_check(~0U, ipa_build(~0U, ~0U, ~0U, ~0U), BITS_PER_IP_ADDRESS);
+  for (i = 0; i < 8; i++)
+    for (j = i; j <= 8; j++)
+      for (k = 0; k < 16; k++)
+	{
+	  for (m = 0; m < 8; m++)
+	    {
+	      seed = seed * 1103515245 + 12345;
+	      w[m] = ((m >= i) && (m < j)) ? 0 : (seed >> (4 + (k & 12))) & 0xffff;
+	    }
+	  if (k == 15)
+	    w[5] = 0xffff;
+	  sdn_encode_check(seed, ipa_build((w[0] << 16) | w[1], (w[2] << 16) | w[3],
+					   (w[4] << 16) | w[5], (w[6] << 16) | w[7]),
+			   seed % (BITS_PER_IP_ADDRESS + 1));
+	}
+#endif
+}
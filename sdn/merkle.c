@@ -0,0 +1,167 @@
+/*
+ *	BIRD -- SDN Hash Tree
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Hash tree
+ *
+ * To let a controller check that its copy of the shadow table matches
+ * ours without a full dump, the SDN protocol keeps a hash tree over the
+ * table. The address space is split into %SDN_MERKLE_LEAVES ranges by
+ * the top %SDN_MERKLE_BITS bits of the prefix; each range is a leaf of
+ * a complete binary tree. The tree is stored as an array in heap order:
+ * node 1 is the root covering everything, node @n has children 2@n and
+ * 2@n+1, and the leaves are nodes %SDN_MERKLE_LEAVES to
+ * 2*%SDN_MERKLE_LEAVES-1. A node at depth @d thus covers the prefixes
+ * whose top @d bits equal @n - 2^@d.
+ *
+ * The digest of a node is the XOR of the hashes of all live entries in
+ * its range, so adding or removing an entry just XORs its hash into the
+ * %SDN_MERKLE_BITS+1 nodes on the path from its leaf to the root. The
+ * entry hash is 64-bit FNV-1a over the prefix in network byte order,
+ * one byte of prefix length and the next hop in network byte order. For
+ * a multipath route, the next hop is replaced by all of its next hops in
+ * ascending order, each followed by one byte of its weight. The
+ * controller computes the same over its own table. Every leaf also keeps
+ * a list of its entries, so the entries of any range can be sent without
+ * walking the whole table.
+ */
+
+#include "nest/bird.h"
+#include "lib/lists.h"
+#include "lib/resource.h"
+
+#include "sdn.h"
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+static inline u64
+sdn_fnv(u64 h, byte *buf, int len)
+{
+  while (len--)
+    h = (h ^ *buf++) * FNV_PRIME;
+  return h;
+}
+
+/**
+ * sdn_merkle_hash - hash of a shadow table entry
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @nexthop: next hop
+ */
+u64
+sdn_merkle_hash(ip_addr prefix, int pxlen, ip_addr nexthop)
+{
+  byte len = pxlen;
+  u64 h = FNV_OFFSET;
+
+  ipa_hton(prefix);
+  ipa_hton(nexthop);
+  h = sdn_fnv(h, (byte *) &prefix, sizeof(prefix));
+  h = sdn_fnv(h, &len, 1);
+  return sdn_fnv(h, (byte *) &nexthop, sizeof(nexthop));
+}
+
+/**
+ * sdn_merkle_hash_group - hash of a multipath shadow table entry
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ * @g: its next hop group
+ */
+u64
+sdn_merkle_hash_group(ip_addr prefix, int pxlen, struct sdn_group *g)
+{
+  byte len = pxlen, weight;
+  u64 h = FNV_OFFSET;
+  ip_addr gw;
+  int i;
+
+  ipa_hton(prefix);
+  h = sdn_fnv(h, (byte *) &prefix, sizeof(prefix));
+  h = sdn_fnv(h, &len, 1);
+  for (i = 0; i < g->count; i++)
+    {
+      gw = g->hop[i].gw;
+      ipa_hton(gw);
+      weight = g->hop[i].weight;
+      h = sdn_fnv(h, (byte *) &gw, sizeof(gw));
+      h = sdn_fnv(h, &weight, 1);
+    }
+  return h;
+}
+
+/**
+ * sdn_merkle_leaf - find the leaf covering a prefix
+ * @prefix: network prefix
+ *
+ * Returns the node number of the leaf.
+ */
+unsigned
+sdn_merkle_leaf(ip_addr prefix)
+{
+#ifndef IPV6
+  u32 top = ipa_to_u32(prefix);
+#else
+  u32 top = _I0(prefix);
+#endif
+
+  return SDN_MERKLE_LEAVES + (top >> (32 - SDN_MERKLE_BITS));
+}
+
+/**
+ * sdn_merkle_init - initialize an empty hash tree
+ * @m: the tree
+ * @pool: pool to allocate it from
+ */
+void
+sdn_merkle_init(struct sdn_merkle *m, pool *pool)
+{
+  int i;
+
+  m->hash = mb_allocz(pool, 2 * SDN_MERKLE_LEAVES * sizeof(u64));
+  m->count = mb_allocz(pool, 2 * SDN_MERKLE_LEAVES * sizeof(u32));
+  m->leaf = mb_alloc(pool, SDN_MERKLE_LEAVES * sizeof(list));
+  for (i = 0; i < SDN_MERKLE_LEAVES; i++)
+    init_list(&m->leaf[i]);
+}
+
+static void
+sdn_merkle_toggle(struct sdn_merkle *m, struct sdn_entry *e, u64 hash, int diff)
+{
+  unsigned n;
+
+  for (n = sdn_merkle_leaf(e->n.prefix); n; n >>= 1)
+    {
+      m->hash[n] ^= hash;
+      m->count[n] += diff;
+    }
+}
+
+/**
+ * sdn_merkle_add - add a live entry to the tree
+ * @m: the tree
+ * @e: the entry
+ * @hash: its sdn_merkle_hash()
+ */
+void
+sdn_merkle_add(struct sdn_merkle *m, struct sdn_entry *e, u64 hash)
+{
+  sdn_merkle_toggle(m, e, hash, 1);
+  add_tail(&m->leaf[sdn_merkle_leaf(e->n.prefix) - SDN_MERKLE_LEAVES], &SDN_EXT(e)->leaf);
+}
+
+/**
+ * sdn_merkle_remove - remove an entry from the tree
+ * @m: the tree
+ * @e: the entry
+ * @hash: the hash it was added with
+ */
+void
+sdn_merkle_remove(struct sdn_merkle *m, struct sdn_entry *e, u64 hash)
+{
+  sdn_merkle_toggle(m, e, hash, -1);
+  rem_node(&SDN_EXT(e)->leaf);
+}
@@ -0,0 +1,241 @@
+/*
+ *	BIRD -- SDN Next Hop Table
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Next hop table
+ *
+ * A shadow table holds up to millions of routes, but only a handful of
+ * distinct next hops. The entries therefore do not store the next hop
+ * itself, just a 32-bit index to a table of interned next hops, which
+ * is reference counted by the entries (and their older versions) using
+ * it. Index 0 always stands for no next hop. A slot holds either a
+ * single next hop address or, for multipath routes, a group: the set of
+ * weighted next hops, sorted so that the same set always gives the same
+ * group whatever order the route lists it in. All routes with the same
+ * set thus share one group, and the group number is what their records
+ * carry.
+ *
+ * Free slots are kept on a free list and reused before the table grows;
+ * lookups go through a hash table of chains linked by index, which is
+ * doubled as the table fills up.
+ */
+
+#include "nest/bird.h"
+#include "lib/resource.h"
+
+#include "sdn.h"
+
+#define SDN_NH_ORDER_MIN	4
+#define SDN_NH_ORDER_MAX	16
+
+static inline u32
+sdn_nh_key(struct sdn_nexthops *t, struct sdn_nexthop *n)
+{
+  u32 h = n->group ? (u32) (n->group->hash ^ (n->group->hash >> 32)) : ipa_hash(n->addr);
+
+  return (h ^ (h >> 16)) & ((1 << t->order) - 1);
+}
+
+/**
+ * sdn_nh_init - initialize an empty next hop table
+ * @t: the table
+ * @pool: pool to allocate it from
+ */
+void
+sdn_nh_init(struct sdn_nexthops *t, pool *pool)
+{
+  t->pool = pool;
+  t->size = 1 << SDN_NH_ORDER_MIN;
+  t->nh = mb_allocz(pool, t->size * sizeof(struct sdn_nexthop));
+  t->order = SDN_NH_ORDER_MIN;
+  t->hash = mb_allocz(pool, (1 << t->order) * sizeof(u32));
+  t->used = 1;
+  t->count = 0;
+  t->groups = 0;
+  t->free = 0;
+
+  /* Slot 0 is no next hop, it is neither hashed nor ever freed */
+  t->nh[0].addr = IPA_NONE;
+  t->nh[0].uses = 1;
+}
+
+static void
+sdn_nh_rehash(struct sdn_nexthops *t, int order)
+{
+  u32 i, h;
+
+  mb_free(t->hash);
+  t->order = order;
+  t->hash = mb_allocz(t->pool, (1 << order) * sizeof(u32));
+
+  for (i = 1; i < t->used; i++)
+    if (t->nh[i].uses)
+      {
+	h = sdn_nh_key(t, &t->nh[i]);
+	t->nh[i].next = t->hash[h];
+	t->hash[h] = i;
+      }
+}
+
+/* Take a free slot and hash it, @n tells what goes in */
+static u32
+sdn_nh_insert(struct sdn_nexthops *t, struct sdn_nexthop *n)
+{
+  u32 h = sdn_nh_key(t, n), i;
+
+  if (t->free)
+    {
+      i = t->free;
+      t->free = t->nh[i].next;
+    }
+  else
+    {
+      if (t->used == t->size)
+	{
+	  t->nh = mb_realloc(t->nh, 2 * t->size * sizeof(struct sdn_nexthop));
+	  memset(t->nh + t->size, 0, t->size * sizeof(struct sdn_nexthop));
+	  t->size *= 2;
+	}
+      i = t->used++;
+    }
+
+  t->nh[i] = *n;
+  t->nh[i].uses = 1;
+  t->nh[i].next = t->hash[h];
+  t->hash[h] = i;
+
+  if ((++t->count > (2U << t->order)) && (t->order < SDN_NH_ORDER_MAX))
+    sdn_nh_rehash(t, t->order + 1);
+  return i;
+}
+
+/**
+ * sdn_nh_get - intern a next hop
+ * @t: the table
+ * @a: next hop address, %IPA_NONE for none
+ *
+ * Returns the index of the next hop, with a new reference taken.
+ */
+u32
+sdn_nh_get(struct sdn_nexthops *t, ip_addr a)
+{
+  struct sdn_nexthop n = { .addr = a };
+  u32 i;
+
+  if (ipa_zero(a))
+    return 0;
+
+  for (i = t->hash[sdn_nh_key(t, &n)]; i; i = t->nh[i].next)
+    if (!t->nh[i].group && ipa_equal(t->nh[i].addr, a))
+      {
+	t->nh[i].uses++;
+	return i;
+      }
+
+  return sdn_nh_insert(t, &n);
+}
+
+static inline int
+sdn_hop_compare(struct sdn_group_hop *a, struct sdn_group_hop *b)
+{
+  int c = ipa_compare(a->gw, b->gw);
+
+  return c ? c : (int) a->weight - (int) b->weight;
+}
+
+/**
+ * sdn_nh_get_group - intern a multipath next hop set
+ * @t: the table
+ * @nhs: the next hops of a %RTD_MULTIPATH route
+ *
+ * Returns the index of the group, with a new reference taken.
+ */
+u32
+sdn_nh_get_group(struct sdn_nexthops *t, struct mpnh *nhs)
+{
+  struct sdn_nexthop n = { .addr = IPA_NONE };
+  struct sdn_group *g, *x;
+  struct sdn_group_hop hop;
+  struct mpnh *nh;
+  int count = 0, i, j;
+  u32 k;
+
+  for (nh = nhs; nh; nh = nh->next)
+    count++;
+  if (!count)
+    return 0;
+
+  g = mb_alloc(t->pool, sizeof(struct sdn_group) + count * sizeof(struct sdn_group_hop));
+  g->count = count;
+  g->told = 0;
+
+  /* Insertion sort, the sets are small */
+  for (nh = nhs, i = 0; nh; nh = nh->next, i++)
+    {
+      hop.gw = nh->gw;
+      hop.weight = nh->weight + 1;
+      for (j = i; (j > 0) && (sdn_hop_compare(&g->hop[j-1], &hop) > 0); j--)
+	g->hop[j] = g->hop[j-1];
+      g->hop[j] = hop;
+    }
+  g->hash = sdn_merkle_hash_group(IPA_NONE, 0, g);
+  n.group = g;
+
+  for (k = t->hash[sdn_nh_key(t, &n)]; k; k = t->nh[k].next)
+    if ((x = t->nh[k].group) && (x->hash == g->hash) && (x->count == count) &&
+	!memcmp(x->hop, g->hop, count * sizeof(struct sdn_group_hop)))
+      {
+	mb_free(g);
+	t->nh[k].uses++;
+	return k;
+      }
+
+  t->groups++;
+  return sdn_nh_insert(t, &n);
+}
+
+/**
+ * sdn_nh_hold - take another reference to a next hop
+ * @t: the table
+ * @i: its index
+ */
+void
+sdn_nh_hold(struct sdn_nexthops *t, u32 i)
+{
+  t->nh[i].uses++;
+}
+
+/**
+ * sdn_nh_put - drop a reference to a next hop
+ * @t: the table
+ * @i: its index
+ *
+ * The slot is freed with the last reference.
+ */
+void
+sdn_nh_put(struct sdn_nexthops *t, u32 i)
+{
+  struct sdn_nexthop *n = &t->nh[i];
+  u32 *ip;
+
+  if (!i || --n->uses)
+    return;
+
+  for (ip = &t->hash[sdn_nh_key(t, n)]; *ip != i; ip = &t->nh[*ip].next)
+    ;
+  *ip = n->next;
+
+  if (n->group)
+    {
+      mb_free(n->group);
+      n->group = NULL;
+      t->groups--;
+    }
+
+  n->next = t->free;
+  t->free = i;
+  t->count--;
+}
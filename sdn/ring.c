@@ -0,0 +1,146 @@
+/*
+ *	BIRD -- SDN Controller Ring
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Controller ring
+ *
+ * Routes can be spread over several RheaFlow instances, each of them
+ * programming its own share of the prefixes. Who gets a prefix is
+ * decided by consistent hashing: every controller is given
+ * %SDN_RING_POINTS points on a ring of 32-bit hashes, derived from its
+ * host name and port, and a prefix belongs to the controller owning
+ * the first point at or after the hash of the prefix and its length.
+ * When a controller is added or removed, only the prefixes between its
+ * points and the points preceding them change hands, about 1/@n of
+ * them, and the rest stay where they are.
+ *
+ * The points are kept sorted in an array, so a lookup is a binary
+ * search. With a single controller there is nothing to look up.
+ */
+
+#include <stdlib.h>
+
+#include "nest/bird.h"
+#include "lib/resource.h"
+#include "lib/unaligned.h"
+
+#include "sdn.h"
+
+#define FNV_OFFSET32	0x811c9dc5
+#define FNV_PRIME32	0x01000193
+
+static inline u32
+sdn_ring_fnv(u32 h, byte *buf, int len)
+{
+  while (len--)
+    h = (h ^ *buf++) * FNV_PRIME32;
+  return h;
+}
+
+/* FNV alone spreads short keys poorly over the ring */
+static inline u32
+sdn_ring_mix(u32 h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  return h ^ (h >> 16);
+}
+
+/**
+ * sdn_ring_hash - position of a prefix on the ring
+ * @prefix: network prefix
+ * @pxlen: prefix length
+ */
+u32
+sdn_ring_hash(ip_addr prefix, int pxlen)
+{
+  byte len = pxlen;
+  u32 h;
+
+  ipa_hton(prefix);
+  h = sdn_ring_fnv(FNV_OFFSET32, (byte *) &prefix, sizeof(prefix));
+  return sdn_ring_mix(sdn_ring_fnv(h, &len, 1));
+}
+
+static int
+sdn_ring_cmp(const void *a, const void *b)
+{
+  const struct sdn_ring_point *x = a, *y = b;
+
+  if (x->hash != y->hash)
+    return (x->hash < y->hash) ? -1 : 1;
+  return (int) x->id - (int) y->id;
+}
+
+/**
+ * sdn_ring_build - place controllers on the ring
+ * @r: the ring, its old points are freed
+ * @pool: pool to allocate the points from
+ * @ctl: controllers by ID, %NULL for unused IDs
+ *
+ * There has to be at least one controller.
+ */
+void
+sdn_ring_build(struct sdn_ring *r, pool *pool, struct sdn_controller **ctl)
+{
+  struct sdn_ring_point *pt;
+  byte port[2];
+  u32 h;
+  int i, j;
+
+  if (r->point)
+    mb_free(r->point);
+
+  r->count = r->controllers = 0;
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    if (ctl[i])
+      r->single = i, r->controllers++;
+
+  r->point = mb_alloc(pool, r->controllers * SDN_RING_POINTS * sizeof(struct sdn_ring_point));
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    if (ctl[i])
+      {
+	put_u16(port, ctl[i]->cf->port);
+	h = sdn_ring_fnv(FNV_OFFSET32, (byte *) ctl[i]->cf->host, strlen(ctl[i]->cf->host));
+	h = sdn_ring_fnv(h, port, 2);
+	for (j = 0; j < SDN_RING_POINTS; j++)
+	  {
+	    pt = &r->point[r->count++];
+	    pt->hash = sdn_ring_mix(h ^ (j * FNV_PRIME32));
+	    pt->id = i;
+	  }
+      }
+
+  qsort(r->point, r->count, sizeof(struct sdn_ring_point), sdn_ring_cmp);
+}
+
+/**
+ * sdn_ring_owner - controller a route belongs to
+ * @r: the ring
+ * @hash: sdn_ring_hash() of the route
+ *
+ * Returns the ID of the controller.
+ */
+int
+sdn_ring_owner(struct sdn_ring *r, u32 hash)
+{
+  int lo = 0, hi = r->count, mid;
+
+  if (r->controllers == 1)
+    return r->single;
+
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (r->point[mid].hash < hash)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return r->point[(lo < r->count) ? lo : 0].id;
+}
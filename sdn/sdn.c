@@ -10,25 +10,57 @@
  * DOC: SDN
  *
  * The SDN protocol
+ *
+ * Routes exported to the protocol, from its main table and any number of
+ * other tables, are kept in shadow tables and sent to the RheaFlow
+ * controller as <SDN_ANNOUNCE> messages, batched over one connection,
+ * which is made and remade in the background without holding up the
+ * protocol. The routes can also be spread over several RheaFlow
+ * instances by consistent hashing of the prefixes; see ring.c. RheaFlow
+ * reports back which routes it has installed; those it has not are
+ * announced again after a while. With a stale time, withdrawals of an
+ * upstream session reset or a refeed wait for a sweep, so that routes
+ * withdrawn and announced again never reach RheaFlow.
+ * Every record carries the ID of the table it belongs to. The ZeroMQ
+ * endpoint serves controller requests: <SDN_PUSH> carries a batch of
+ * routes to be announced into or withdrawn from BIRD, <SDN_DIGEST> and
+ * <SDN_RANGE> let the controller compare its copy of the shadow table
+ * with ours range by range, <SDN_SUBSCRIBE> limits what a client is
+ * told to the prefixes it is interested in and has changes of them
+ * pushed to it, <SDN_GROUPS> returns the next hop groups of multipath
+ * routes, anything else is taken as a request for a dump of the shadow
+ * table.
+ *
+ * With a flow table budget, RheaFlow gets just the best ranked routes
+ * that fit in it, plus default routes; see budget.c.
+ *
+ * A multipath route is sent as one record referring to a group of
+ * weighted next hops by number; see nexthop.c. RheaFlow gets each group
+ * defined once in a <SDN_GROUP> message before its first use.
  */
 
 #undef LOCAL_DEBUG
 #define LOCAL_DEBUG 1
 
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <zmq.h>
 #include "nest/bird.h"
 #include "nest/iface.h"
 #include "nest/protocol.h"
 #include "nest/route.h"
+#include "nest/cli.h"
+#include "filter/filter.h"
 #include "lib/socket.h"
 #include "lib/zeromq.h"
 #include "sysdep/unix/unix.h"
 #include "lib/resource.h"
 #include "lib/lists.h"
 #include "lib/timer.h"
+#include "lib/event.h"
 #include "lib/string.h"
+#include "conf/conf.h"
 
 /* Include header files for socket */
 #include <sys/socket.h>
@@ -50,9 +82,34 @@ static struct sdn_interface *new_iface(struct proto *p, struct iface *new, unsig
 static sock* init_unix_socket(struct proto *p);
 static zeromq* init_zeromq(struct proto *p);
 static void sdn_route_print_to_sockets(struct proto* p, char* route);
-int RheaSockfd;
-char  Rheabuffer[256];
-int nsent;
+static bird_clock_t sdn_rte_expires(struct sdn_wheel *w, node *n);
+static void sdn_rte_expire(struct sdn_wheel *w, node *n);
+static void sdn_timer(timer *t);
+static void sdn_init_entry(struct fib_node *fn);
+static void sdn_init_entry_ext(struct fib_node *fn);
+static void sdn_dump_event(void *data);
+static void sdn_entry_update(struct proto *p, struct sdn_entry *e, int live);
+static void sdn_entry_withdraw(struct proto *p, struct sdn_entry *e);
+static void sdn_journal_add(struct proto *p, struct sdn_entry *e, int removed);
+static void sdn_subs_notify(struct proto *p, struct sdn_entry *e, int removed);
+static bird_clock_t sdn_damp_expires(struct sdn_wheel *w, node *n);
+static void sdn_damp_expire(struct sdn_wheel *w, node *n);
+static u32 sdn_damp_ceiling(struct proto *p);
+static bird_clock_t sdn_retry_expires(struct sdn_wheel *w, node *n);
+static void sdn_retry_expire(struct sdn_wheel *w, node *n);
+static void sdn_budget_moved(struct sdn_budget *b, struct sdn_entry *e, int in);
+static void sdn_stale_sweep(timer *tm);
+static void sdn_timed_timer(timer *t);
+static int sdn_timed_zmq_rx(zeromq *z, int size);
+static int sdn_timed_ctl_rx(sock *s, int size);
+static void sdn_timed_dump_event(void *data);
+static void sdn_timed_batch_event(void *data);
+static void sdn_timed_replay_event(void *data);
+static void sdn_timed_stale_sweep(timer *tm);
+static void sdn_ctl_start(struct proto *p);
+static char *sdn_ctl_state(struct sdn_controller *c, char *buf);
+static u64 sdn_ctl_sent(struct proto *p);
+static void sdn_export(struct proto *p, struct sdn_table *t, ip_addr prefix, int pxlen, rta *a, u32 tag);
 /*
  * Input processing
  *
@@ -65,42 +122,6 @@ int nsent;
  * This part is responsible for getting packets out to the network.
  */
 
-/* Error logging for TCP client socket */
-static void client_error(const char *msg)
-{
-   log( L_ERR "Unexpected error for RheaFlow client: %s", msg);
-}
-
-
-/* creata a TCP socket and establish a connection to
- * 
- * to RheaFlow.
- */
-static int init_rhea_client()
-{
-    int sockfd, n;
-    int portno = 55650;
-    char* server_name = "localhost";
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
-
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0 )
-        log( L_ERR "ERROR opening socket to connect to RheaFlow");
-    server = gethostbyname(server_name);
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr,
-         (char *)&serv_addr.sin_addr.s_addr,
-         server->h_length);
-    serv_addr.sin_port = htons(portno);
-    /* Initiate connection to the server */
-    if (connect(sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0 )
-       log(L_ERR "ERROR connecting to server");
-
-    return sockfd;
-}
-
 static void
 sdn_tx_err( sock *s, int err )
 {
@@ -131,29 +152,333 @@ sdn_rx(sock *s, int size)
   return 1;
 }
 
+/*
+ * Interfaces are also indexed by their system index, so that both
+ * interface events and packets received on the shared socket find
+ * theirs without walking the list.
+ */
 static struct sdn_interface*
 find_interface(struct proto *p, struct iface *what)
 {
-  struct sdn_interface *i;
+  unsigned i = what->index;
 
-  WALK_LIST (i, P->interfaces)
-    if (i->iface == what)
-      return i;
-  return NULL;
+  return (i < P->if_size) ? P->if_index[i] : NULL;
+}
+
+static void
+sdn_iface_link(struct proto *p, struct sdn_interface *rif)
+{
+  unsigned i = rif->iface->index, size;
+
+  if (i >= P->if_size)
+    {
+      size = MAX(MAX(2 * P->if_size, i + 1), 64);
+      if (P->if_index)
+	P->if_index = mb_realloc(P->if_index, size * sizeof(struct sdn_interface *));
+      else
+	P->if_index = mb_alloc(p->pool, size * sizeof(struct sdn_interface *));
+      memset(P->if_index + P->if_size, 0, (size - P->if_size) * sizeof(struct sdn_interface *));
+      P->if_size = size;
+    }
+
+  P->if_index[i] = rif;
+  add_head(&P->interfaces, NODE rif);
+}
+
+static void
+sdn_iface_unlink(struct proto *p, struct sdn_interface *rif)
+{
+  P->if_index[rif->iface->index] = NULL;
+  rem_node(NODE rif);
+}
+
+static inline ip_addr
+sdn_mcast_addr(void)
+{
+#ifndef IPV6
+  return ipa_from_u32(0xe0000009);
+#else
+  return ipa_build(0xff020000, 0, 0, 9);
+#endif
+}
+
+/*
+ * Shared socket
+ *
+ * Instead of a socket (and an object lock) per interface, the protocol
+ * can use a single socket bound to its port on all interfaces, which
+ * scales to hosts with thousands of VLAN and tunnel interfaces. Packets
+ * are attributed to interfaces by the index the kernel passes along
+ * (SKF_LADDR_RX), multicast groups are joined per interface on the one
+ * socket, and adding or removing an interface is just an update of the
+ * index. The receive buffer is allocated only once there is an
+ * interface to receive on; the transmit buffer is never needed.
+ */
+
+#define SDN_RBSIZE	10240
+
+static int
+sdn_shared_rx(sock *s, int size)
+{
+  struct proto *p = s->data;
+  unsigned i = s->lifindex;
+
+  if ((i >= P->if_size) || !P->if_index[i])
+    {
+      DBG("sdn: packet on unknown interface %u\n", i);
+      return 1;
+    }
+
+  TRACE(D_PACKETS, "Got a packet on %s", P->if_index[i]->iface->name);
+  return 1;
+}
+
+static void
+sdn_shared_err(sock *s, int err)
+{
+  struct proto *p = s->data;
+
+  log( L_ERR "%s: Socket error: %M", p->name, err );
+}
+
+/* Join or leave the multicast group on an interface, sk_join_group() takes it from the socket */
+static void
+sdn_shared_group(struct proto *p, struct sdn_interface *rif, int join)
+{
+  sock *s = P->shared;
+  int res;
+
+  s->iface = rif->iface;
+  res = join ? sk_join_group(s, sdn_mcast_addr()) : sk_leave_group(s, sdn_mcast_addr());
+  s->iface = NULL;
+
+  if (res < 0)
+    sk_log_error(s, p->name);
+}
+
+/* The socket receives only while there are interfaces to receive on */
+static void
+sdn_shared_update(struct proto *p)
+{
+  sock *s = P->shared;
+
+  if (!s)
+    return;
+
+  if (!EMPTY_LIST(P->interfaces))
+    {
+      sk_set_rbsize(s, SDN_RBSIZE);
+      s->rx_hook = sdn_shared_rx;
+    }
+  else
+    s->rx_hook = NULL;
+}
+
+static void
+sdn_shared_open(struct object_lock *lock)
+{
+  struct proto *p = lock->data;
+  struct sdn_interface *rif;
+  sock *s;
+
+  s = sk_new( p->pool );
+  s->type = SK_UDP;
+  s->sport = P_CF->port;
+  s->dport = P_CF->port;
+  s->data = p;
+  s->err_hook = sdn_shared_err;
+  s->flags = SKF_LADDR_RX;
+  s->tos = IP_PREC_INTERNET_CONTROL;
+  s->ttl = 1;
+
+  if ((sk_open(s) < 0) || (sk_setup_broadcast(s) < 0))
+    {
+      sk_log_error(s, p->name);
+      log(L_ERR "%s: Cannot open shared socket", p->name);
+      rfree(s);
+      return;
+    }
+
+  P->shared = s;
+  WALK_LIST(rif, P->interfaces)
+    if (rif->multicast)
+      sdn_shared_group(p, rif, 1);
+  sdn_shared_update(p);
+
+  TRACE(D_EVENTS, "Listening on port %d, shared by all interfaces", P_CF->port);
+}
+
+static void
+sdn_shared_start(struct proto *p)
+{
+  struct object_lock *lock = olock_new( p->pool );
+
+  lock->addr = IPA_NONE;
+  lock->port = P_CF->port;
+  lock->iface = NULL;
+  lock->hook = sdn_shared_open;
+  lock->data = p;
+  lock->type = OBJLOCK_UDP;
+  P->shared_lock = lock;
+  olock_acquire(lock);
+}
+
+static void
+sdn_shared_if_add(struct proto *p, struct iface *iface, struct iface_patt *patt)
+{
+  struct sdn_patt *PATT = (struct sdn_patt *) patt;
+  struct sdn_interface *rif;
+
+  rif = mb_allocz(p->pool, sizeof( struct sdn_interface ));
+  rif->iface = iface;
+  rif->proto = p;
+  rif->mode = PATT->mode;
+  rif->metric = PATT->metric;
+  rif->multicast = (!(PATT->mode & IM_BROADCAST)) && (iface->flags & IF_MULTICAST);
+  sdn_iface_link(p, rif);
+
+  if (P->shared && rif->multicast)
+    sdn_shared_group(p, rif, 1);
+  sdn_shared_update(p);
+
+  TRACE(D_EVENTS, "Listening on %s, mode %s", iface->name, rif->multicast ? "multicast" : "broadcast");
 }
 
 /*
  * Interface to BIRD core
  */
 
+static inline ip_addr
+sdn_entry_nexthop(struct proto *p, struct sdn_entry *e)
+{
+  return sdn_nh_addr(&P->nexthops, e->nh);
+}
+
+static inline u64
+sdn_entry_hash(struct proto *p, struct sdn_entry *e)
+{
+  struct sdn_group *g = sdn_nh_group(&P->nexthops, e->nh);
+
+  if (g)
+    return sdn_merkle_hash_group(e->n.prefix, e->n.pxlen, g);
+  return sdn_merkle_hash(e->n.prefix, e->n.pxlen, sdn_entry_nexthop(p, e));
+}
+
+/* Interned next hop of a route, a group for multipath ones */
+static u32
+sdn_rta_nexthop(struct proto *p, rta *a)
+{
+  switch (a->dest)
+    {
+    case RTD_ROUTER:
+      return sdn_nh_get(&P->nexthops, a->gw);
+    case RTD_MULTIPATH:
+      return sdn_nh_get_group(&P->nexthops, a->nexthops);
+    default:
+      return 0;
+    }
+}
+
+/* Record of a route via @nh, with the next hop even if there is none */
+static char *
+sdn_put_record(struct proto *p, char *buf, u32 table, ip_addr prefix, int pxlen, u32 nh)
+{
+  if (sdn_nh_group(&P->nexthops, nh))
+    return sdn_put_route_group(buf, table, prefix, pxlen, nh);
+  return sdn_put_route(buf, table, prefix, pxlen, &P->nexthops.nh[nh].addr);
+}
+
 static void
-sdn_dump_entry( struct sdn_entry *e )
+sdn_dump_entry( struct proto *p, struct sdn_entry *e )
 {
-  debug( "%I told me %d/%d ago: to %I/%d go via %I, metric %d ",
-  e->whotoldme, e->updated-now, e->changed-now, e->n.prefix, e->n.pxlen, e->nexthop, e->metric );
+  debug( "%I/%d via %I (#%u)%s",
+  e->n.prefix, e->n.pxlen, sdn_entry_nexthop(p, e), e->nh,
+  (e->n.flags & SEF_DELETED) ? " (deleted)" : "" );
+  if (!P_CF->compact)
+    debug( ", gen %lu%s", (unsigned long) SDN_EXT(e)->gen, SDN_EXT(e)->rec ? " (cached)" : "" );
   debug( "\n" );
 }
 
+/*
+ * Tables
+ *
+ * Besides its main table, the protocol can export any number of other
+ * tables (VRFs, typically), each with an ID of its own which goes out
+ * in every record. Every table has its own shadow table and hash tree;
+ * sequence numbers, dumps and the controller connection are shared.
+ *
+ * With the compact option, the shadow table entries drop everything but
+ * the prefix and its next hop (&sdn_entry_ext is left out), and so there
+ * is no hash tree, no record cache, no dampening and dumps show the
+ * current state instead of a snapshot.
+ */
+
+static inline unsigned
+sdn_entry_size(struct proto *p)
+{
+  return sizeof(struct sdn_entry) + (P_CF->compact ? 0 : sizeof(struct sdn_entry_ext));
+}
+
+static struct sdn_table *
+sdn_table_add(struct proto *p, struct rtable *table, u32 id)
+{
+  struct sdn_table *t = mb_allocz(p->pool, sizeof(struct sdn_table));
+
+  t->id = id;
+  t->table = table;
+  fib_init( &t->fib, p->pool, sdn_entry_size(p), 0, P_CF->compact ? sdn_init_entry : sdn_init_entry_ext );
+  if (!P_CF->compact)
+    sdn_merkle_init( &t->merkle, p->pool );
+  add_tail( &P->tables, NODE t );
+  return t;
+}
+
+static void
+sdn_tables_init(struct proto *p)
+{
+  struct sdn_table_config *tc;
+  struct sdn_table *mt, *t;
+
+  init_list( &P->tables );
+  mt = sdn_table_add( p, p->table, 0 );
+
+  WALK_LIST( tc, P_CF->tables )
+    {
+      if (tc->table->table == p->table)
+	{
+	  mt->id = tc->id;
+	  continue;
+	}
+
+      t = sdn_table_add( p, tc->table->table, tc->id );
+      t->ahook = proto_add_announce_hook( p, t->table, &p->stats );
+      t->ahook->out_filter = p->cf->out_filter;
+      rt_lock_table( t->table );
+    }
+}
+
+static inline struct sdn_table *
+sdn_table_find(struct proto *p, struct rtable *table)
+{
+  struct sdn_table *t;
+
+  WALK_LIST(t, P->tables)
+    if (t->table == table)
+      return t;
+  return NULL;
+}
+
+static struct sdn_table *
+sdn_table_find_id(struct proto *p, u32 id)
+{
+  struct sdn_table *t;
+
+  WALK_LIST(t, P->tables)
+    if (t->id == id)
+      return t;
+  return NULL;
+}
+
 /*
  * sdn_start - initialize instance of sdn
  */
@@ -168,30 +493,106 @@ sdn_start(struct proto *p)
   P->magic = SDN_MAGIC;
 #endif
 
-  fib_init( &P->rtable, p->pool, sizeof( struct sdn_entry ), 0, NULL );
+  sdn_encode_init();
+  sdn_tables_init(p);
   init_list( &P->connections );
-  init_list( &P->garbage );
+  init_list( &P->subscriptions );
+  init_list( &P->journal );
+  init_list( &P->cow );
+  P->version_slab = sl_new( p->pool, sizeof( struct sdn_version ));
+  P->delta_slab = sl_new( p->pool, sizeof( struct sdn_delta ));
+  P->cow_slab = sl_new( p->pool, sizeof( struct sdn_cow ));
+  P->rec_slab = sl_new( p->pool, SDN_REC_SIZE );
+  sdn_nh_init( &P->nexthops, p->pool );
+  P->dump_event = ev_new( p->pool );
+  P->dump_event->hook = sdn_timed_dump_event;
+  P->dump_event->data = p;
+  sdn_wheel_init( &P->garbage, now );
+  P->garbage.expires = sdn_rte_expires;
+  P->garbage.expire = sdn_rte_expire;
+  P->garbage.data = p;
+  sdn_wheel_init( &P->reuse, now );
+  P->reuse.expires = sdn_damp_expires;
+  P->reuse.expire = sdn_damp_expire;
+  P->reuse.data = p;
+  init_list( &P->reused );
+  P->damp_slab = sl_new( p->pool, sizeof( struct sdn_damp ));
+  P->damp_ceiling = sdn_damp_ceiling(p);
+  sdn_wheel_init( &P->retry, now );
+  P->retry.expires = sdn_retry_expires;
+  P->retry.expire = sdn_retry_expire;
+  P->retry.data = p;
+  P->retry_slab = sl_new( p->pool, sizeof( struct sdn_retry ));
+  memset( P->status_count, 0, sizeof( P->status_count ));
+  sdn_budget_init( &P->budget, p->pool, P_CF->budget );
+  P->budget.moved = sdn_budget_moved;
+  P->budget.data = p;
+  P->stale_timer = tm_new( p->pool );
+  P->stale_timer->data = p;
+  P->stale_timer->hook = sdn_timed_stale_sweep;
+  P->stale_until = 0;
+  P->stale_feed = 0;
+  P->stale_count = 0;
+  P->stale_kept = P->stale_swept = 0;
+  memset( P->hooks, 0, sizeof( P->hooks ));
   init_list( &P->interfaces );
   init_list( &P->sockets );
+  if (P_CF->shared_socket)
+    sdn_shared_start(p);
+  P->push_pool = lp_new( p->pool, 4080 );
   //DBG( "sdn: initialised lists\n" );
   //rif = new_iface(p, NULL, 0, NULL);	/* Initialize dummy interface */
   zwrapper = mb_alloc( p->pool, sizeof( struct sdn_zeromq_wrapper ));
   // we're going to build zmq sockets instead
   //swrapper->skt = init_unix_socket(p);
   zwrapper->skt = init_zeromq(p);
-  // Start the RheaFlow client socket 
-  RheaSockfd = init_rhea_client();
+  P->syncing = P_CF->initial_snapshot;
+  P->threads = sdn_encode_threads( P_CF->encode_threads );
+  // Connect to RheaFlow in the background
+  sdn_ctl_start(p);
+  if (P_CF->record && !(P->trace = sdn_trace_create(p->pool, P_CF->record)))
+    log(L_ERR "%s: Cannot create trace %s: %m", p->name, P_CF->record);
   // URL tcp://*:5556
   //add_head( &P->interfaces, NODE rif );
-  add_head( &P->sockets, NODE zwrapper );
+  if (zwrapper->skt)
+    add_head( &P->sockets, NODE zwrapper );
+  else
+    mb_free( zwrapper );
   CHK_MAGIC;
 
   sdn_init_instance(p);
 
+  P->timer = tm_new( p->pool );
+  P->timer->data = p;
+  P->timer->randomize = 0;
+  P->timer->hook = sdn_timed_timer;
+  P->timer->recurrent = 1;
+  tm_start( P->timer, 1 );
+
   DBG( "sdn: ...done\n" );
   return PS_UP;
 }
 
+static void
+sdn_cleanup(struct proto *p)
+{
+  struct sdn_table_config *tc;
+  int i;
+
+  WALK_LIST( tc, P_CF->tables )
+    if (tc->table->table != p->table)
+      rt_unlock_table( tc->table->table );
+
+  /* The sockets go with the pool */
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    P->ctl[i] = NULL;
+  P->ring.point = NULL;
+
+  if (P->trace)
+    sdn_trace_close( P->trace );
+  P->trace = NULL;
+}
+
 static struct proto *
 sdn_init(struct proto_config *cfg)
 {
@@ -206,23 +607,97 @@ sdn_dump(struct proto *p)
   int i;
   node *w;
   struct sdn_interface *rif;
+  struct sdn_table *t;
 
   CHK_MAGIC;
   WALK_LIST( w, P->connections ) {
     struct sdn_connection *n = (void *) w;
-    debug( "sdn: connection #%d: %I\n", n->num, n->addr );
+    debug( "sdn: connection #%d: snapshot %lu, %s\n", n->num, (unsigned long) n->seq, n->done ? "sending changes" : "walking" );
+  }
+  debug( "sdn: %lu exports suppressed as unchanged, %d prefixes dampened\n", (unsigned long) P->suppressed, P->damp_count );
+  WALK_LIST( w, P->subscriptions ) {
+    struct sdn_subscription *s = (void *) w;
+    debug( "sdn: subscription to %d patterns, table %d, %u changes lost\n", s->count, s->table, s->lost );
+  }
+  WALK_LIST( t, P->tables ) {
+    debug( "sdn: table %s, id %u\n", t->table->name, t->id );
+    i = 0;
+    FIB_WALK( &t->fib, e ) {
+      debug( "sdn: entry #%d: ", i++ );
+      sdn_dump_entry( p, (struct sdn_entry *)e );
+    } FIB_WALK_END;
   }
-  i = 0;
-  FIB_WALK( &P->rtable, e ) {
-    debug( "sdn: entry #%d: ", i++ );
-    sdn_dump_entry( (struct sdn_entry *)e );
-  } FIB_WALK_END;
   i = 0;
   WALK_LIST( rif, P->interfaces ) {
-    debug( "sdn: interface #%d: %s, %I, busy = %x\n", i++, rif->iface?rif->iface->name:"(dummy)", rif->sock->daddr, rif->busy );
+    debug( "sdn: interface #%d: %s, %I, busy = %x\n", i++, rif->iface?rif->iface->name:"(dummy)", rif->sock ? rif->sock->daddr : IPA_NONE, rif->busy );
   }
 }
 
+/*
+ * sdn_sh - show protocol state and the memory it takes
+ */
+void
+sdn_sh(struct proto *p)
+{
+  struct sdn_nexthops *nh = &P->nexthops;
+  struct sdn_controller *c;
+  struct sdn_table *t;
+  unsigned long bytes, total = 0;
+  u32 routes = 0, i;
+  char state[32];
+
+  if (p->proto_state != PS_UP)
+    {
+      cli_msg(-1021, "%s: is not up", p->name);
+      cli_msg(0, "");
+      return;
+    }
+
+  cli_msg(-1021, "%s:", p->name);
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    if (c = P->ctl[i])
+      cli_msg(-1021, "Controller %s (%I port %d): %s, %lu routes, %lu kB sent", c->cf->host, c->cf->addr,
+	      c->cf->port, sdn_ctl_state(c, state), (unsigned long) c->records, (unsigned long) (c->sent >> 10));
+  if (P->replay)
+    cli_msg(-1021, "Replaying %s: %lu events", P->replay->name, (unsigned long) P->replay->events);
+  WALK_LIST(t, P->tables)
+    {
+      bytes = t->fib.entries * sdn_entry_size(p) + t->fib.hash_size * sizeof(struct fib_node *);
+      cli_msg(-1021, "Table %s (ID %u): %u routes, %u entries, %lu kB",
+	      t->table->name, t->id, t->routes, t->fib.entries, bytes >> 10);
+      routes += t->routes;
+      total += bytes;
+    }
+
+  bytes = nh->size * sizeof(struct sdn_nexthop) + (1 << nh->order) * sizeof(u32);
+  for (i = 1; i < nh->used; i++)
+    if (nh->nh[i].uses && nh->nh[i].group)
+      bytes += sizeof(struct sdn_group) + nh->nh[i].group->count * sizeof(struct sdn_group_hop);
+  cli_msg(-1021, "Next hops: %u (%u groups), %lu kB", nh->count, nh->groups, bytes >> 10);
+  total += bytes;
+
+  bytes = P->rec_count * (unsigned long) SDN_REC_SIZE;
+  cli_msg(-1021, "Cached records: %u, %lu kB", P->rec_count, bytes >> 10);
+  total += bytes;
+
+  cli_msg(-1021, "Routes: %u installed, %u rejected, %u table full, %u pending, %u retrying, %lu retries sent",
+	  P->status_count[SEF_INSTALLED >> 2], P->status_count[SEF_REJECTED >> 2], P->status_count[SEF_FULL >> 2],
+	  routes - P->status_count[1] - P->status_count[2] - P->status_count[3],
+	  P->retry.count, (unsigned long) P->retried);
+  if (P->budget.limit)
+    {
+      bytes = (P->budget.in.size + P->budget.out.size) * (unsigned long) sizeof(struct sdn_heap_item);
+      cli_msg(-1021, "Budget: %u of %u routes sent, %lu moves, %lu kB", P->budget.in.count,
+	      P->budget.in.count + P->budget.out.count, (unsigned long) P->budget.moves, bytes >> 10);
+      total += bytes;
+    }
+  if (P_CF->stale_time)
+    cli_msg(-1021, "Stale: %u routes, %lu kept, %lu withdrawn", P->stale_count,
+	    (unsigned long) P->stale_kept, (unsigned long) P->stale_swept);
+  cli_msg(-1021, "Total: %lu kB, %lu bytes per route", total >> 10, routes ? total / routes : 0);
+  cli_msg(0, "");
+}
+
 static void
 sdn_get_route_info(rte *rte, byte *buf, ea_list *attrs)
 {
@@ -237,8 +712,13 @@ sdn_get_route_info(rte *rte, byte *buf, ea_list *attrs)
 static void
 kill_iface(struct sdn_interface *i)
 {
+  struct proto *p = i->proto;
+
   DBG( "sdn: Interface %s disappeared\n", i->iface->name);
-  rfree(i->sock);
+  if (i->sock)
+    rfree(i->sock);
+  else if (P->shared && i->multicast)
+    sdn_shared_group(p, i, 0);
   mb_free(i);
 }
 
@@ -248,600 +728,3392 @@ unix_tx(sock *s)
   log_msg(L_DEBUG "sending");
 }
 
-static int
-zeromq_rx(zeromq *z, int size)
+/*
+ * Controller requests
+ *
+ * Requests arrive on the ZeroMQ endpoint as a tag followed by a JSON
+ * body in the same shape as the <SDN_ANNOUNCE> messages we send out.
+ * The parser below understands just enough JSON for that: it works in
+ * place on the request as ZeroMQ received it, however long it is up to
+ * the request size, and never copies anything but addresses.
+ */
+
+struct sdn_parser {
+  char *pos, *end;
+};
+
+#define SDN_KEY(key, len, str) (((len) == sizeof(str) - 1) && !memcmp(key, str, len))
+
+static inline void
+sdn_parse_ws(struct sdn_parser *ps)
 {
-  struct proto *p;
-  struct sdn_entry *entry;
-  char* outbuffer = NULL;
-  //char* routestring = "<SDN_DUMP> [%s]\n";
-  //char* perroutestring = "{\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}";
-  char* routestring = "<SDN_DUMP> {\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}";
-  char* endstring = "done\n";
-  int len = 0;
-  //char* addedstring = "<SDN_ANNOUNCE> {\"added\" : [{\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}] }\n";
-  z->rpos = z->rbuf;
-  z->rpos[size] = '\0';
-  log_msg(L_DEBUG "got packet on socket: <%s>\n", z->rpos);
-  p = z->data;
-  log_msg(L_DEBUG "");
-  FIB_WALK( &P->rtable, e ) {
-    entry = (struct sdn_entry*) e;
-    len = strlen(routestring) + 33 + 3 + 33;
-    outbuffer = xmalloc(len+1);
-    outbuffer[len] = '\0';
-    bsnprintf(outbuffer, len, routestring, entry->n.prefix, entry->n.pxlen, entry->nexthop);
-    //sdn_route_print_to_sockets(p, outbuffer);
-    // this should be in zq_write or zq_send, fix later
-    log_msg(L_DEBUG "%s\n", outbuffer);
-    zmq_send(z->fd, outbuffer, strlen(outbuffer), ZMQ_SNDMORE);
-    free(outbuffer);
-    //log_msg(L_DEBUG "%I told me %d/%d ago: to %I/%d go via %I, metric %d ",
-    //entry->whotoldme, entry->updated-now, entry->changed-now, entry->n.prefix, entry->n.pxlen, entry->nexthop, entry->metric );
-  } FIB_WALK_END;
-  zmq_send(z->fd, endstring, strlen(endstring), 0);
-  // send stuff back to garyland
-  //s->tbuf = "gary";
-  //sk_send(s, 5);
-  return 0;
+  while ((ps->pos < ps->end) &&
+	 ((*ps->pos == ' ') || (*ps->pos == '\t') || (*ps->pos == '\r') || (*ps->pos == '\n')))
+    ps->pos++;
 }
 
 static int
-unix_rx(sock *s, int size UNUSED)
+sdn_parse_char(struct sdn_parser *ps, char c)
 {
-  struct proto *p;
-  struct sdn_entry *entry;
-  char* outbuffer = NULL;
-  //char* routestring = "<SDN_DUMP> [%s]\n";
-  //char* perroutestring = "{\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}";
-  char* routestring = "<SDN_DUMP> {\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}\n";
-  int len = 0;
-  //char* addedstring = "<SDN_ANNOUNCE> {\"added\" : [{\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}] }\n";
-  log_msg(L_DEBUG "got packet on socket");
-  p = s->data;
-  FIB_WALK( &P->rtable, e ) {
-    entry = (struct sdn_entry*) e;
-    len = strlen(routestring) + 33 + 3 + 33;
-    outbuffer = xmalloc(len+1);
-    outbuffer[len] = '\0';
-    bsnprintf(outbuffer, len, routestring, entry->n.prefix, entry->n.pxlen, entry->nexthop);
-    sdn_route_print_to_sockets(p, outbuffer);
-    free(outbuffer);
-    //log_msg(L_DEBUG "%I told me %d/%d ago: to %I/%d go via %I, metric %d ",
-    //entry->whotoldme, entry->updated-now, entry->changed-now, entry->n.prefix, entry->n.pxlen, entry->nexthop, entry->metric );
-  } FIB_WALK_END;
-  // send stuff back to garyland
-  //s->tbuf = "gary";
-  //sk_send(s, 5);
-  return 0;
+  sdn_parse_ws(ps);
+  if ((ps->pos >= ps->end) || (*ps->pos != c))
+    return 0;
+  ps->pos++;
+  return 1;
 }
 
-static void
-unix_err(sock *s, int err UNUSED)
+/* Escapes are skipped over, but not interpreted */
+static int
+sdn_parse_string(struct sdn_parser *ps, char **str, int *len)
 {
-  log_msg(L_ERR "got error on socket");
+  char *s;
+
+  if (!sdn_parse_char(ps, '"'))
+    return 0;
+  for (s = ps->pos; (ps->pos < ps->end) && (*ps->pos != '"'); ps->pos++)
+    if ((*ps->pos == '\\') && (ps->pos + 1 < ps->end))
+      ps->pos++;
+  if (ps->pos >= ps->end)
+    return 0;
+  *str = s;
+  *len = ps->pos++ - s;
+  return 1;
 }
 
 static int
-unix_connect(sock *s, int size UNUSED)
+sdn_parse_int(struct sdn_parser *ps, int *val)
 {
-  struct proto *p=NULL;
-  struct proto_config *pc;
-  log_msg(L_DEBUG "someone connected to our socket");
-  WALK_LIST(pc, config->protos){
-    if (pc->protocol == &proto_sdn && pc->proto){
-      log_msg(L_DEBUG "this is the droid we're looking for");
-      p = pc->proto;
-    }
-    log_msg(L_DEBUG "gary");
-  }
-  if(!p) return 0;
-  s->rx_hook = unix_rx;
-  s->tx_hook = unix_tx;
-  s->type = SK_MAGIC;
-  s->err_hook = unix_err;
-  s->data = p;
-  //s->pool = c->pool;            /* We need to have all the socket buffers allocated in the cli pool */
-  //c->rx_pos = c->rx_buf;
-  //c->rx_aux = NULL;
-  //rmove(s, c->pool);
-  // add socket to pool
-  CHK_MAGIC;
-  //add_head( &P->sockets, NODE s );
-  //sk_insert(s);
+  int neg = 0, digits = 0;
+  s64 v = 0;
+
+  sdn_parse_ws(ps);
+  if ((ps->pos < ps->end) && (*ps->pos == '-'))
+    neg = 1, ps->pos++;
+  for (; (ps->pos < ps->end) && (*ps->pos >= '0') && (*ps->pos <= '9'); ps->pos++, digits++)
+    if ((v = v*10 + (*ps->pos - '0')) > 0x7fffffff)
+      return 0;
+  if (!digits)
+    return 0;
+  *val = neg ? -v : v;
+  return 1;
+}
+
+static int
+sdn_parse_ip(struct sdn_parser *ps, ip_addr *a)
+{
+  char buf[STD_ADDRESS_P_LENGTH + 1];
+  char *s;
+  int len;
+
+  if (!sdn_parse_string(ps, &s, &len) || (len > STD_ADDRESS_P_LENGTH))
+    return 0;
+  memcpy(buf, s, len);
+  buf[len] = 0;
+  return ip_pton(buf, a);
+}
+
+/* Skip over a value we are not interested in */
+static int
+sdn_parse_skip(struct sdn_parser *ps)
+{
+  int depth = 0;
+  char *s;
+  int len;
+
+  sdn_parse_ws(ps);
+  while (ps->pos < ps->end)
+    {
+      char c = *ps->pos;
+
+      if (c == '"')
+	{
+	  if (!sdn_parse_string(ps, &s, &len))
+	    return 0;
+	}
+      else if ((c == '{') || (c == '['))
+	depth++, ps->pos++;
+      else if ((c == '}') || (c == ']'))
+	{
+	  if (!depth)
+	    return 1;
+	  depth--, ps->pos++;
+	}
+      else if ((c == ',') && !depth)
+	return 1;
+      else
+	ps->pos++;
+
+      if (!depth && ((c == '"') || (c == '}') || (c == ']')))
+	return 1;
+    }
+  return !depth;
+}
+
+/*
+ * Object and array walkers: return 1 for the next member, 0 at the end
+ * (closing bracket consumed) and -1 on malformed input. @n counts the
+ * members seen so far and must start at zero, just after the opening bracket.
+ */
+static int
+sdn_parse_member(struct sdn_parser *ps, int *n, char **key, int *len)
+{
+  if (sdn_parse_char(ps, '}'))
+    return 0;
+  if ((*n)++ && !sdn_parse_char(ps, ','))
+    return -1;
+  if (!sdn_parse_string(ps, key, len) || !sdn_parse_char(ps, ':'))
+    return -1;
+  return 1;
+}
+
+static int
+sdn_parse_element(struct sdn_parser *ps, int *n)
+{
+  if (sdn_parse_char(ps, ']'))
+    return 0;
+  if ((*n)++ && !sdn_parse_char(ps, ','))
+    return -1;
+  return 1;
+}
+
+struct sdn_route_req {
+  int table;			/* -1 for the main one */
+  ip_addr prefix;
+  int pxlen;
+  ip_addr via;
+  int metric;
+  int tag;
+};
+
+static int
+sdn_parse_route(struct sdn_parser *ps, struct sdn_route_req *r)
+{
+  char *key;
+  int len, n = 0, res;
+
+  r->table = -1;
+  r->prefix = IPA_NONE;
+  r->pxlen = -1;
+  r->via = IPA_NONE;
+  r->metric = 1;
+  r->tag = 0;
+
+  if (!sdn_parse_char(ps, '{'))
+    return 0;
+  while ((res = sdn_parse_member(ps, &n, &key, &len)) > 0)
+    {
+      if (SDN_KEY(key, len, "table"))
+	res = sdn_parse_int(ps, &r->table);
+      else if (SDN_KEY(key, len, "prefix"))
+	res = sdn_parse_ip(ps, &r->prefix);
+      else if (SDN_KEY(key, len, "mask"))
+	res = sdn_parse_int(ps, &r->pxlen);
+      else if (SDN_KEY(key, len, "via"))
+	res = sdn_parse_ip(ps, &r->via);
+      else if (SDN_KEY(key, len, "metric"))
+	res = sdn_parse_int(ps, &r->metric);
+      else if (SDN_KEY(key, len, "tag"))
+	res = sdn_parse_int(ps, &r->tag);
+      else
+	res = sdn_parse_skip(ps);
+      if (!res)
+	return 0;
+    }
+  return !res;
+}
+
+static inline int
+sdn_route_req_valid(struct sdn_route_req *r)
+{
+  return (r->pxlen >= 0) && (r->pxlen <= BITS_PER_IP_ADDRESS) &&
+    ipa_equal(r->prefix, ipa_and(r->prefix, ipa_mkmask(r->pxlen)));
+}
+
+/*
+ * Route injection
+ *
+ * A <SDN_PUSH> request carries a batch of routes to announce ("added")
+ * and withdraw ("removed"). Routes are applied as they are parsed. All
+ * routes sharing a next hop share one cached rta, looked up once per
+ * request, so a batch costs one rte_update() per route and one
+ * rta_lookup() per next hop.
+ */
+
+#define SDN_PUSH_GROUPS 64
+
+struct sdn_push_group {
+  struct sdn_push_group *next;
+  ip_addr gw;
+  rta *attrs;			/* NULL if gw is not a neighbor */
+};
+
+struct sdn_push {
+  struct proto *proto;
+  struct sdn_push_group *groups[SDN_PUSH_GROUPS];
+  int added, removed, rejected;
+};
+
+static rta *
+sdn_push_attrs(struct sdn_push *ps, ip_addr gw)
+{
+  struct proto *p = ps->proto;
+  struct sdn_push_group **gp = &ps->groups[ipa_hash(gw) & (SDN_PUSH_GROUPS - 1)];
+  struct sdn_push_group *g;
+  neighbor *nb;
+  rta a;
+
+  for (g = *gp; g; g = g->next)
+    if (ipa_equal(g->gw, gw))
+      return g->attrs;
+
+  g = lp_alloc(P->push_pool, sizeof(struct sdn_push_group));
+  g->gw = gw;
+  g->attrs = NULL;
+  g->next = *gp;
+  *gp = g;
+
+  /* Like other protocols, route only via neighbors we can reach */
+  nb = neigh_find2(p, &gw, NULL, 0);
+  if (!nb || !nb->iface || (nb->scope == SCOPE_HOST))
+    {
+      log(L_REMOTE "%s: Controller asked me to route via %s %I", p->name,
+	  nb ? "local address" : "non-neighbor", gw);
+      return NULL;
+    }
+
+  memset(&a, 0, sizeof(a));
+  a.src = p->main_source;
+  a.source = RTS_SDN;
+  a.scope = SCOPE_UNIVERSE;
+  a.cast = RTC_UNICAST;
+  a.dest = RTD_ROUTER;
+  a.gw = gw;
+  a.from = IPA_NONE;
+  a.iface = nb->iface;
+  g->attrs = rta_lookup(&a);
+  return g->attrs;
+}
+
+static void
+sdn_push_add(struct sdn_push *ps, struct sdn_route_req *r)
+{
+  struct proto *p = ps->proto;
+  rta *a;
+  net *n;
+  rte *e;
+
+  if (!sdn_route_req_valid(r) || !ipa_nonzero(r->via) || !(a = sdn_push_attrs(ps, r->via)))
+    {
+      ps->rejected++;
+      return;
+    }
+
+  n = net_get(p->table, r->prefix, r->pxlen);
+  e = rte_get_temp(rta_clone(a));
+  e->net = n;
+  e->pflags = 0;
+  e->lastmod = now;
+  e->u.sdn.metric = MAX(MIN(r->metric, P_CF->infinity), 1);
+  e->u.sdn.tag = r->tag;
+  e->u.sdn.entry = NULL;
+  rte_update(p, n, e);
+  ps->added++;
+}
+
+static void
+sdn_push_remove(struct sdn_push *ps, struct sdn_route_req *r)
+{
+  struct proto *p = ps->proto;
+  net *n;
+
+  if (!sdn_route_req_valid(r) || !(n = net_find(p->table, r->prefix, r->pxlen)))
+    {
+      ps->rejected++;
+      return;
+    }
+
+  rte_update(p, n, NULL);
+  ps->removed++;
+}
+
+static int
+sdn_push_list(struct sdn_push *ps, struct sdn_parser *pr, int add)
+{
+  struct sdn_route_req r;
+  int n = 0, res;
+
+  if (!sdn_parse_char(pr, '['))
+    return 0;
+  while ((res = sdn_parse_element(pr, &n)) > 0)
+    {
+      if (!sdn_parse_route(pr, &r))
+	return 0;
+      if (add)
+	sdn_push_add(ps, &r);
+      else
+	sdn_push_remove(ps, &r);
+    }
+  return !res;
+}
+
+static int
+sdn_push(struct proto *p, char *msg, int len, char *reply, int rlen)
+{
+  struct sdn_parser pr = { msg, msg + len };
+  struct sdn_push ps;
+  struct sdn_push_group *g;
+  char *key;
+  int klen, i, n = 0, res;
+
+  memset(&ps, 0, sizeof(ps));
+  ps.proto = p;
+
+  if (!sdn_parse_char(&pr, '{'))
+    res = -1;
+  else
+    while ((res = sdn_parse_member(&pr, &n, &key, &klen)) > 0)
+      {
+	if (SDN_KEY(key, klen, "added"))
+	  res = sdn_push_list(&ps, &pr, 1);
+	else if (SDN_KEY(key, klen, "removed"))
+	  res = sdn_push_list(&ps, &pr, 0);
+	else
+	  res = sdn_parse_skip(&pr);
+	if (!res)
+	  {
+	    res = -1;
+	    break;
+	  }
+      }
+
+  for (i = 0; i < SDN_PUSH_GROUPS; i++)
+    for (g = ps.groups[i]; g; g = g->next)
+      if (g->attrs)
+	rta_free(g->attrs);
+  lp_flush(P->push_pool);
+
+  if (res < 0)
+    log(L_REMOTE "%s: Malformed push request from controller", p->name);
+  TRACE(D_ROUTES, "Controller push: %d added, %d removed, %d rejected",
+	ps.added, ps.removed, ps.rejected);
+
+  return bsnprintf(reply, rlen, "<SDN_PUSH> {\"status\" : \"%s\", \"added\" : %d, \"removed\" : %d, \"rejected\" : %d}\n",
+		   (res < 0) ? "error" : "ok", ps.added, ps.removed, ps.rejected);
+}
+
+/*
+ * Snapshots
+ *
+ * Every change of the shadow table gets a new sequence number, which is
+ * stored in the changed entry (its generation). A dump shows the table
+ * exactly as it was at the sequence number it was started at, although
+ * it is sent in slices while the table keeps changing: when an entry
+ * visible to a running dump is changed or withdrawn, its previous state
+ * is copied to a version chain hanging off the entry and withdrawn
+ * entries are kept as tombstones. A dump then shows the newest version
+ * not younger than its snapshot. Once the whole table is walked, the
+ * dump continues with the changes made in the meantime, taken from the
+ * journal, and finishes with the sequence number it has caught up with.
+ *
+ * Versions and journal records exist only while a dump is running;
+ * they are pruned as dumps progress. Tombstones stay as long as a dump
+ * or the flap history of the prefix needs them.
+ */
+
+#define SDN_DUMP_SLICE	256	/* Records sent to one client per event */
+#define SDN_RECORD_MAX	192	/* Longest record we encode */
+
+/*
+ * A live entry keeps its record once it has been encoded, so that
+ * sending it again, in a dump or a range reply, is just a copy. The
+ * record is dropped whenever the entry changes and encoded again when
+ * it is next needed, so routes nobody asks for cost nothing.
+ */
+
+/* Record of @e as it is now, the next hop left out if there is none */
+static char *
+sdn_entry_encode(struct proto *p, struct sdn_entry *e, char *buf)
+{
+  if (e->nh)
+    return sdn_put_record(p, buf, e->tab->id, e->n.prefix, e->n.pxlen, e->nh);
+  return sdn_put_route(buf, e->tab->id, e->n.prefix, e->n.pxlen, NULL);
+}
+
+static int
+sdn_entry_record(struct proto *p, struct sdn_entry *e, char *buf)
+{
+  struct sdn_entry_ext *x = SDN_EXT(e);
+
+  /* Compact entries have no room for the cache */
+  if (P_CF->compact)
+    return sdn_entry_encode(p, e, buf) - buf;
+
+  if (!x->rec)
+    {
+      x->rec = sl_alloc(P->rec_slab);
+      e->n.x0 = sdn_entry_encode(p, e, x->rec) - x->rec;
+      P->rec_count++;
+    }
+  memcpy(buf, x->rec, e->n.x0);
+  return e->n.x0;
+}
+
+static inline void
+sdn_entry_uncache(struct proto *p, struct sdn_entry *e)
+{
+  struct sdn_entry_ext *x = SDN_EXT(e);
+
+  if (!P_CF->compact && x->rec)
+    {
+      sl_free(P->rec_slab, x->rec);
+      x->rec = NULL;
+      P->rec_count--;
+    }
+}
+
+/* One element of a route list */
+static int
+sdn_format_route(struct proto *p, char *buf, int n, struct sdn_entry *e)
+{
+  int len = 0;
+
+  if (n)
+    {
+      memcpy(buf, ", ", 2);
+      len = 2;
+    }
+  return len + sdn_entry_record(p, e, buf + len);
+}
+
+static void
+sdn_init_entry(struct fib_node *fn)
+{
+  /* fib_get() leaves these to us, and the entry state is kept in them */
+  fn->flags = 0;
+  fn->x0 = 0;
+  memset(((byte *) fn) + sizeof(struct fib_node), 0, sizeof(struct sdn_entry) - sizeof(struct fib_node));
+}
+
+static void
+sdn_init_entry_ext(struct fib_node *fn)
+{
+  sdn_init_entry(fn);
+  memset(SDN_EXT((struct sdn_entry *) fn), 0, sizeof(struct sdn_entry_ext));
+}
+
+/* Recompute the newest snapshot still being walked */
+static void
+sdn_snapshot_update(struct proto *p)
+{
+  struct sdn_connection *c;
+
+  P->snap_max = 0;
+  WALK_LIST(c, P->connections)
+    if (!c->done)
+      P->snap_max = MAX(P->snap_max, c->seq);
+}
+
+/* Is there a snapshot taken between @from (incl.) and @to (excl.) still being walked? */
+static int
+sdn_snapshot_needs(struct proto *p, u64 from, u64 to)
+{
+  struct sdn_connection *c;
+
+  WALK_LIST(c, P->connections)
+    if (!c->done && (from <= c->seq) && (c->seq < to))
+      return 1;
+  return 0;
+}
+
+/*
+ * sdn_entry_cow - preserve the current state of @e if a running
+ * snapshot can see it. Must be called before any change of the entry.
+ */
+static void
+sdn_entry_cow(struct proto *p, struct sdn_entry *e)
+{
+  struct sdn_entry_ext *x = SDN_EXT(e);
+  struct sdn_version *v;
+  struct sdn_cow *c;
+
+  /* Fresh entries have nothing to preserve, compact ones keep nothing */
+  if (P_CF->compact || !x->gen || (x->gen > P->snap_max))
+    return;
+
+  v = sl_alloc(P->version_slab);
+  v->gen = x->gen;
+  v->deleted = !!(e->n.flags & SEF_DELETED);
+  v->nh = e->nh;
+  sdn_nh_hold(&P->nexthops, v->nh);
+  v->next = x->old;
+  x->old = v;
+
+  if (!(e->n.flags & SEF_COW))
+    {
+      c = sl_alloc(P->cow_slab);
+      c->e = e;
+      add_tail(&P->cow, &c->n);
+      e->n.flags |= SEF_COW;
+    }
+}
+
+/* Delete a tombstone nobody needs any more */
+static void
+sdn_entry_gc(struct proto *p, struct sdn_entry *e)
+{
+  if ((e->n.flags & SEF_DELETED) && !(e->n.flags & (SEF_COW | SEF_RETRY)) &&
+      (P_CF->compact || !SDN_EXT(e)->damp))
+    fib_delete(&e->tab->fib, e);
+}
+
+/* Record what the controller made of @e, keeping the counts in step */
+static inline void
+sdn_entry_status(struct proto *p, struct sdn_entry *e, int status)
+{
+  int old = e->n.flags & SEF_STATUS;
+
+  if (old)
+    P->status_count[old >> 2]--;
+  if (status)
+    P->status_count[status >> 2]++;
+  e->n.flags = (e->n.flags & ~SEF_STATUS) | status;
+}
+
+/* Drop versions no running snapshot can see and tombstones without versions */
+static void
+sdn_cow_prune(struct proto *p)
+{
+  struct sdn_cow *c, *nxt;
+  struct sdn_version *v, **vp;
+  struct sdn_entry *e;
+  u64 newer, gen;
+
+  WALK_LIST_DELSAFE(c, nxt, P->cow)
+    {
+      e = c->e;
+      newer = SDN_EXT(e)->gen;
+      vp = &SDN_EXT(e)->old;
+      while (v = *vp)
+	{
+	  gen = v->gen;
+	  if (sdn_snapshot_needs(p, gen, newer))
+	    vp = &v->next;
+	  else
+	    {
+	      *vp = v->next;
+	      sdn_nh_put(&P->nexthops, v->nh);
+	      sl_free(P->version_slab, v);
+	    }
+	  newer = gen;
+	}
+
+      if (SDN_EXT(e)->old)
+	continue;
+
+      rem_node(&c->n);
+      sl_free(P->cow_slab, c);
+      e->n.flags &= ~SEF_COW;
+      sdn_entry_gc(p, e);
+    }
+}
+
+/*
+ * State of @e seen by a snapshot taken at @seq, 0 if not in it. Compact
+ * entries have just their current state, which the dump may then show
+ * along with the journal record of the change.
+ */
+static int
+sdn_entry_at(struct proto *p, struct sdn_entry *e, u64 seq, u32 *nh)
+{
+  struct sdn_version *v;
+
+  if (P_CF->compact || (SDN_EXT(e)->gen <= seq))
+    {
+      *nh = e->nh;
+      return !(e->n.flags & SEF_DELETED);
+    }
+
+  for (v = SDN_EXT(e)->old; v; v = v->next)
+    if (v->gen <= seq)
+      {
+	*nh = v->nh;
+	return !v->deleted;
+      }
+
+  return 0;
+}
+
+/* Every change of the shadow table gets the next sequence number */
+static inline void
+sdn_entry_gen(struct proto *p, struct sdn_entry *e)
+{
+  P->seq++;
+  if (!P_CF->compact)
+    SDN_EXT(e)->gen = P->seq;
+}
+
+/* Every change of the shadow table passes here */
+static void
+sdn_journal_add(struct proto *p, struct sdn_entry *e, int removed)
+{
+  struct sdn_delta *d;
+
+  if (!EMPTY_LIST(P->subscriptions))
+    sdn_subs_notify(p, e, removed);
+
+  if (EMPTY_LIST(P->connections))
+    return;
+
+  d = sl_alloc(P->delta_slab);
+  d->seq = P->seq;
+  d->table = e->tab->id;
+  d->prefix = e->n.prefix;
+  d->pxlen = e->n.pxlen;
+  d->removed = removed;
+  d->nh = e->nh;
+  sdn_nh_hold(&P->nexthops, d->nh);
+  add_tail(&P->journal, &d->n);
+}
+
+/* Drop journal records every running dump has already got past */
+static void
+sdn_journal_prune(struct proto *p)
+{
+  struct sdn_connection *c;
+  struct sdn_delta *d;
+  u64 min = ~(u64) 0;
+
+  WALK_LIST(c, P->connections)
+    min = MIN(min, c->done ? c->sent : c->seq);
+
+  WALK_LIST_FIRST(d, P->journal)
+    {
+      if (d->seq > min)
+	break;
+      rem_node(&d->n);
+      sdn_nh_put(&P->nexthops, d->nh);
+      sl_free(P->delta_slab, d);
+    }
+}
+
+/*
+ * sdn_entry_update - the shadow table entry is about to change
+ * @e: the entry, possibly fresh from fib_get()
+ * @live: it is in the shadow table now
+ *
+ * Assigns a new generation. The caller then fills in the new state,
+ * puts the entry back to the hash tree and calls sdn_journal_add().
+ */
+static void
+sdn_entry_update(struct proto *p, struct sdn_entry *e, int live)
+{
+  if (live && !P_CF->compact)
+    sdn_merkle_remove(&e->tab->merkle, e, sdn_entry_hash(p, e));
+  sdn_entry_uncache(p, e);
+  sdn_entry_cow(p, e);
+  sdn_entry_status(p, e, SEF_PENDING);
+  sdn_entry_gen(p, e);
+  e->n.flags &= ~SEF_DELETED;
+}
+
+/*
+ * sdn_entry_withdraw - remove @e from the shadow table, leaving
+ * a tombstone if a running snapshot or its flap history needs it
+ */
+static void
+sdn_entry_withdraw(struct proto *p, struct sdn_entry *e)
+{
+  if (!P_CF->compact)
+    sdn_merkle_remove(&e->tab->merkle, e, sdn_entry_hash(p, e));
+  sdn_entry_cow(p, e);
+  sdn_entry_gen(p, e);
+  e->tab->routes--;
+  sdn_journal_add(p, e, 1);
+  sdn_entry_uncache(p, e);
+  sdn_nh_put(&P->nexthops, e->nh);
+  e->nh = 0;
+
+  sdn_entry_status(p, e, SEF_PENDING);
+  e->n.flags |= SEF_DELETED;
+  sdn_entry_gc(p, e);
+}
+
+/*
+ * Clients
+ *
+ * The endpoint is a ROUTER socket, so any number of clients can talk to
+ * us at once. Each message starts with the identity of the client (and
+ * an empty delimiter for REQ-style peers), which we have to repeat in
+ * front of every message we send back. A client with a dump running has
+ * a session (struct sdn_connection); the dump event takes a slice of
+ * each running dump in turn, so a long dump does not hold up the other
+ * clients. Each slice goes out as a separate message, so a client
+ * asking for dumps has to use a DEALER socket. The socket is in
+ * ZMQ_ROUTER_MANDATORY mode: a client which does not keep up with the
+ * dump just gets skipped until there is room in its queue again.
+ */
+
+struct sdn_msg {		/* A message being sent to a client */
+  struct sdn_connection *c;
+  int open;
+  int held, cur;		/* The last part is held back until we know it is the last one */
+  int len[2];
+  char buf[2][256];
+};
+
+static int
+sdn_msg_open(struct sdn_msg *m)
+{
+  struct sdn_connection *c = m->c;
+
+  if (m->open)
+    return 1;
+
+  if (zmq_send(c->zq->fd, c->id, c->idlen, ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0)
+    {
+      if (zmq_errno() == EHOSTUNREACH)
+	c->gone = 1;
+      return 0;
+    }
+  if (c->delim)
+    zmq_send(c->zq->fd, "", 0, ZMQ_SNDMORE);
+  m->open = 1;
+  return 1;
+}
+
+/* Start the next part, returns the buffer to fill in or NULL */
+static char *
+sdn_msg_next(struct sdn_msg *m)
+{
+  if (!sdn_msg_open(m))
+    return NULL;
+
+  if (m->held)
+    zmq_send(m->c->zq->fd, m->buf[m->cur], m->len[m->cur], ZMQ_SNDMORE);
+  m->cur ^= 1;
+  m->held = 1;
+  return m->buf[m->cur];
+}
+
+static int
+sdn_msg_part(struct sdn_msg *m, char *fmt, ...)
+{
+  va_list args;
+  int len;
+
+  if (!sdn_msg_next(m))
+    return 0;
+
+  va_start(args, fmt);
+  len = bvsnprintf(m->buf[m->cur], sizeof(m->buf[0]), fmt, args);
+  va_end(args);
+  m->len[m->cur] = (len < 0) ? (int) sizeof(m->buf[0]) - 1 : len;
+  return 1;
+}
+
+static void
+sdn_msg_close(struct sdn_msg *m)
+{
+  if (m->held)
+    zmq_send(m->c->zq->fd, m->buf[m->cur], m->len[m->cur], 0);
+}
+
+/* Reply to a client without a session */
+static void
+sdn_client_reply(zeromq *z, byte *id, int idlen, int delim, char *buf, int len)
+{
+  if (zmq_send(z->fd, id, idlen, ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0)
+    return;
+  if (delim)
+    zmq_send(z->fd, "", 0, ZMQ_SNDMORE);
+  zmq_send(z->fd, buf, len, 0);
+}
+
+static void
+sdn_client_status(zeromq *z, byte *id, int idlen, int delim, char *tag, char *status)
+{
+  char reply[64];
+  int len = bsnprintf(reply, sizeof(reply), "%s {\"status\" : \"%s\"}\n", tag, status);
+
+  sdn_client_reply(z, id, idlen, delim, reply, len);
+}
+
+static struct sdn_connection *
+sdn_client_find(struct proto *p, byte *id, int idlen)
+{
+  struct sdn_connection *c;
+
+  WALK_LIST(c, P->connections)
+    if ((c->idlen == idlen) && !memcmp(c->id, id, idlen))
+      return c;
+  return NULL;
+}
+
+/*
+ * Subscriptions
+ *
+ * A client interested in a few prefixes only (a load balancer watching
+ * its VIP ranges, say) registers them with <SDN_SUBSCRIBE> {"table" : T,
+ * "prefixes" : [{"prefix" : P, "mask" : M, "min" : L, "max" : H}, ...]}.
+ * A route matches a pattern if it lies within P/M and its length is
+ * between L and H, which default to M and the full address length. The
+ * patterns are compiled into a prefix trie, so matching a route costs
+ * the same however many of them there are. Without "table", routes of
+ * all tables are watched. A new subscription replaces the previous one
+ * of the client, an empty list cancels it.
+ *
+ * Dumps for a subscribed client then show matching routes only, and
+ * every change of a matching route is pushed to it right away as an
+ * <SDN_ANNOUNCE> {"seq" : S, "added"|"removed" : [route]} message. If
+ * the client does not keep up, changes are dropped and the next message
+ * it gets is <SDN_LOST> {"count" : N}, telling it to ask for a new dump.
+ */
+
+static inline int
+sdn_sub_match(struct sdn_subscription *s, u32 table, ip_addr prefix, int pxlen)
+{
+  return ((s->table < 0) || ((u32) s->table == table)) &&
+    trie_match_prefix(s->trie, prefix, pxlen);
+}
+
+static struct sdn_subscription *
+sdn_sub_find(struct proto *p, byte *id, int idlen)
+{
+  struct sdn_subscription *s;
+
+  WALK_LIST(s, P->subscriptions)
+    if ((s->idlen == idlen) && !memcmp(s->id, id, idlen))
+      return s;
+  return NULL;
+}
+
+static void
+sdn_sub_free(struct proto *p, struct sdn_subscription *s)
+{
+  struct sdn_connection *c;
+
+  /* Running dumps of the client go on unfiltered */
+  WALK_LIST(c, P->connections)
+    if (c->sub == s)
+      c->sub = NULL;
+
+  rem_node(NODE s);
+  rfree(s->lp);
+  mb_free(s);
+}
+
+static int
+sdn_parse_pattern(struct sdn_parser *ps, struct f_trie *trie)
+{
+  ip_addr prefix = IPA_NONE;
+  int pxlen = -1, min = -1, max = BITS_PER_IP_ADDRESS;
+  char *key;
+  int len, n = 0, res;
+
+  if (!sdn_parse_char(ps, '{'))
+    return 0;
+  while ((res = sdn_parse_member(ps, &n, &key, &len)) > 0)
+    {
+      if (SDN_KEY(key, len, "prefix"))
+	res = sdn_parse_ip(ps, &prefix);
+      else if (SDN_KEY(key, len, "mask"))
+	res = sdn_parse_int(ps, &pxlen);
+      else if (SDN_KEY(key, len, "min"))
+	res = sdn_parse_int(ps, &min);
+      else if (SDN_KEY(key, len, "max"))
+	res = sdn_parse_int(ps, &max);
+      else
+	res = sdn_parse_skip(ps);
+      if (!res)
+	return 0;
+    }
+  if (res)
+    return 0;
+
+  if (min < 0)
+    min = pxlen;
+  if ((pxlen < 0) || (pxlen > min) || (min > max) || (max > BITS_PER_IP_ADDRESS) ||
+      !ipa_equal(prefix, ipa_and(prefix, ipa_mkmask(pxlen))))
+    return 0;
+
+  trie_add_prefix(trie, prefix, pxlen, min, max);
+  return 1;
+}
+
+static void
+sdn_subscribe(struct proto *p, zeromq *z, byte *id, int idlen, int delim, char *msg, int len)
+{
+  struct sdn_parser pr = { msg, msg + len };
+  struct sdn_subscription *s;
+  struct sdn_connection *c;
+  struct f_trie *trie;
+  linpool *lp;
+  char *key, reply[96];
+  int klen, table = -1, count = 0, n = 0, m, res;
+
+  lp = lp_new(p->pool, 4080);
+  trie = f_new_trie(lp);
+
+  if (!sdn_parse_char(&pr, '{'))
+    res = -1;
+  else
+    while ((res = sdn_parse_member(&pr, &n, &key, &klen)) > 0)
+      {
+	if (SDN_KEY(key, klen, "table"))
+	  res = sdn_parse_int(&pr, &table);
+	else if (SDN_KEY(key, klen, "prefixes"))
+	  {
+	    m = 0;
+	    if (!sdn_parse_char(&pr, '['))
+	      res = 0;
+	    else
+	      while ((res = sdn_parse_element(&pr, &m)) > 0)
+		if (!sdn_parse_pattern(&pr, trie))
+		  break;
+		else
+		  count++;
+	    res = !res;
+	  }
+	else
+	  res = sdn_parse_skip(&pr);
+	if (!res)
+	  {
+	    res = -1;
+	    break;
+	  }
+      }
+
+  if (res < 0)
+    {
+      log(L_REMOTE "%s: Malformed subscription from controller", p->name);
+      sdn_client_status(z, id, idlen, delim, "<SDN_SUBSCRIBE>", "error");
+      rfree(lp);
+      return;
+    }
+
+  if ((table >= 0) && !sdn_table_find_id(p, table))
+    {
+      sdn_client_status(z, id, idlen, delim, "<SDN_SUBSCRIBE>", "unknown table");
+      rfree(lp);
+      return;
+    }
+
+  if (s = sdn_sub_find(p, id, idlen))
+    sdn_sub_free(p, s);
+
+  if (!count)
+    {
+      rfree(lp);
+      TRACE(D_EVENTS, "Subscription cancelled");
+      sdn_client_status(z, id, idlen, delim, "<SDN_SUBSCRIBE>", "ok");
+      return;
+    }
+
+  s = mb_allocz(p->pool, sizeof(struct sdn_subscription));
+  s->zq = z;
+  memcpy(s->id, id, idlen);
+  s->idlen = idlen;
+  s->delim = delim;
+  s->table = table;
+  s->lp = lp;
+  s->trie = trie;
+  s->count = count;
+  add_tail(&P->subscriptions, NODE s);
+
+  /* A dump already running for the client is filtered from now on */
+  if (c = sdn_client_find(p, id, idlen))
+    c->sub = s;
+
+  TRACE(D_EVENTS, "Subscription to %d prefix patterns", count);
+  len = bsnprintf(reply, sizeof(reply), "<SDN_SUBSCRIBE> {\"status\" : \"ok\", \"seq\" : %lu, \"prefixes\" : %d}\n",
+		  (unsigned long) P->seq, count);
+  sdn_client_reply(z, id, idlen, delim, reply, len);
+}
+
+static int
+sdn_sub_write(struct sdn_subscription *s, char *buf, int len)
+{
+  if (zmq_send(s->zq->fd, s->id, s->idlen, ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0)
+    {
+      if (zmq_errno() == EHOSTUNREACH)
+	s->gone = 1;
+      return 0;
+    }
+  if (s->delim)
+    zmq_send(s->zq->fd, "", 0, ZMQ_SNDMORE);
+  zmq_send(s->zq->fd, buf, len, 0);
+  return 1;
+}
+
+/* Push a message to a subscriber, counting it if it does not get through */
+static void
+sdn_sub_send(struct sdn_subscription *s, char *buf, int len)
+{
+  char notice[64];
+  int nlen;
+
+  if (s->lost)
+    {
+      nlen = bsnprintf(notice, sizeof(notice), "<SDN_LOST> {\"count\" : %u}\n", s->lost);
+      if (!sdn_sub_write(s, notice, nlen))
+	{
+	  s->lost++;
+	  return;
+	}
+      s->lost = 0;
+    }
+
+  if (!sdn_sub_write(s, buf, len))
+    s->lost++;
+}
+
+static void
+sdn_subs_notify(struct proto *p, struct sdn_entry *e, int removed)
+{
+  struct sdn_subscription *s, *nxt;
+  char buf[SDN_RECORD_MAX + 64];
+  int len = 0;
+
+  WALK_LIST_DELSAFE(s, nxt, P->subscriptions)
+    {
+      if (!sdn_sub_match(s, e->tab->id, e->n.prefix, e->n.pxlen))
+	continue;
+
+      if (!len)
+	{
+	  len = bsprintf(buf, "<SDN_ANNOUNCE> {\"seq\" : %lu, \"%s\" : [",
+			 (unsigned long) P->seq, removed ? "removed" : "added");
+	  len += sdn_format_route(p, buf + len, 0, e);
+	  len += bsprintf(buf + len, "]}\n");
+	}
+
+      sdn_sub_send(s, buf, len);
+      if (s->gone)
+	{
+	  TRACE(D_EVENTS, "Subscriber has gone away");
+	  sdn_sub_free(p, s);
+	}
+    }
+}
+
+#define SDN_SLICE_BLOCKED	0	/* Client does not take anything now */
+#define SDN_SLICE_MORE		1
+#define SDN_SLICE_DONE		2
+
+/* Send another slice of a dump */
+static int
+sdn_dump_slice(struct proto *p, struct sdn_connection *c)
+{
+  int budget = SDN_DUMP_SLICE;
+  struct sdn_delta *d;
+  struct sdn_msg m;
+  struct sdn_entry *e;
+  char *buf, *pos;
+  u32 nh;
+
+  memset(&m, 0, sizeof(m));
+  m.c = c;
+
+  while (!c->done)
+    {
+      FIB_ITERATE_START(&c->tab->fib, &c->iter, fn)
+	{
+	  e = (struct sdn_entry *) fn;
+	  if (sdn_entry_at(p, e, c->seq, &nh) &&
+	      (!c->sub || sdn_sub_match(c->sub, c->tab->id, fn->prefix, fn->pxlen)))
+	    {
+	      if (!budget || !(buf = sdn_msg_next(&m)))
+		{
+		  FIB_ITERATE_PUT(&c->iter, fn);
+		  sdn_msg_close(&m);
+		  return m.open ? SDN_SLICE_MORE : SDN_SLICE_BLOCKED;
+		}
+	      pos = SDN_PUT(buf, "<SDN_DUMP> ");
+	      /* The cached record is good unless the dump needs an older version */
+	      if ((P_CF->compact || (SDN_EXT(e)->gen <= c->seq)) && nh)
+		pos += sdn_entry_record(p, e, pos);
+	      else
+		pos = sdn_put_record(p, pos, c->tab->id, fn->prefix, fn->pxlen, nh);
+	      m.len[m.cur] = pos - buf;
+	      budget--;
+	    }
+	}
+      FIB_ITERATE_END(fn);
+
+      if (NODE_VALID(NODE_NEXT(c->tab)))
+	{
+	  c->tab = NODE_NEXT(c->tab);
+	  FIB_ITERATE_INIT(&c->iter, &c->tab->fib);
+	  continue;
+	}
+
+      c->done = 1;
+      c->sent = c->seq;
+      sdn_snapshot_update(p);
+      sdn_cow_prune(p);
+    }
+
+  WALK_LIST(d, P->journal)
+    {
+      if (d->seq <= c->sent)
+	continue;
+
+      if (c->sub && !sdn_sub_match(c->sub, d->table, d->prefix, d->pxlen))
+	{
+	  c->sent = d->seq;
+	  continue;
+	}
+
+      if (!budget || !(buf = sdn_msg_next(&m)))
+	{
+	  sdn_msg_close(&m);
+	  return m.open ? SDN_SLICE_MORE : SDN_SLICE_BLOCKED;
+	}
+      pos = SDN_PUT(buf, "<SDN_DELTA> {\"seq\" : ");
+      pos = sdn_put_uint(pos, d->seq);
+      pos = d->removed ? SDN_PUT(pos, ", \"removed\" : [") : SDN_PUT(pos, ", \"added\" : [");
+      pos = sdn_put_record(p, pos, d->table, d->prefix, d->pxlen, d->nh);
+      pos = SDN_PUT(pos, "]}");
+      m.len[m.cur] = pos - buf;
+      c->sent = d->seq;
+      budget--;
+    }
+
+  if (!sdn_msg_part(&m, "done {\"seq\" : %lu}\n", (unsigned long) c->sent))
+    return SDN_SLICE_BLOCKED;
+  sdn_msg_close(&m);
+  return SDN_SLICE_DONE;
+}
+
+static void
+sdn_dump_restart(struct proto *p, struct sdn_connection *c)
+{
+  c->num = P->dump_count++;
+  c->seq = P->seq;
+  c->sent = 0;
+  c->done = 0;
+  c->tab = HEAD(P->tables);
+  c->sub = sdn_sub_find(p, c->id, c->idlen);
+  FIB_ITERATE_INIT(&c->iter, &c->tab->fib);
+  sdn_snapshot_update(p);
+
+  TRACE(D_EVENTS, "Dump #%d started at sequence %lu", c->num, (unsigned long) c->seq);
+  ev_schedule(P->dump_event);
+}
+
+static void
+sdn_client_free(struct proto *p, struct sdn_connection *c)
+{
+  if (!c->done)
+    FIB_ITERATE_UNLINK(&c->iter, &c->tab->fib);
+  rem_node(NODE c);
+  mb_free(c);
+  sdn_snapshot_update(p);
+  sdn_cow_prune(p);
+}
+
+static void
+sdn_dump_event(void *data)
+{
+  struct proto *p = data;
+  struct sdn_connection *c, *nxt;
+  int progress = 0;
+
+  WALK_LIST_DELSAFE(c, nxt, P->connections)
+    switch (sdn_dump_slice(p, c))
+      {
+      case SDN_SLICE_DONE:
+	TRACE(D_EVENTS, "Dump #%d finished at sequence %lu", c->num, (unsigned long) c->sent);
+	if (c->pending)
+	  {
+	    c->pending--;
+	    sdn_dump_restart(p, c);
+	  }
+	else
+	  sdn_client_free(p, c);
+	progress = 1;
+	break;
+
+      case SDN_SLICE_MORE:
+	progress = 1;
+	break;
+
+      case SDN_SLICE_BLOCKED:
+	if (c->gone)
+	  {
+	    TRACE(D_EVENTS, "Dump #%d aborted, client has gone away", c->num);
+	    sdn_client_free(p, c);
+	  }
+	break;
+      }
+
+  sdn_journal_prune(p);
+
+  /* If all clients are blocked, sdn_timer() gives them another try */
+  if (progress && !EMPTY_LIST(P->connections))
+    ev_schedule(P->dump_event);
+}
+
+static void
+sdn_dump_start(struct proto *p, zeromq *z, byte *id, int idlen, int delim)
+{
+  struct sdn_connection *c = sdn_client_find(p, id, idlen);
+
+  /* One dump at a time for a client, the next one follows when it is done */
+  if (c)
+    {
+      c->pending++;
+      return;
+    }
+
+  c = mb_allocz(p->pool, sizeof(struct sdn_connection));
+  c->proto = p;
+  c->zq = z;
+  memcpy(c->id, id, idlen);
+  c->idlen = idlen;
+  c->delim = delim;
+  add_tail(&P->connections, NODE c);
+  sdn_dump_restart(p, c);
+}
+
+/* Whether another frame of a multipart message follows */
+static int
+sdn_zmq_more(zeromq *z)
+{
+  int more = 0;
+  size_t optlen = sizeof(more);
+
+  return (zmq_getsockopt(z->fd, ZMQ_RCVMORE, &more, &optlen) >= 0) && more;
+}
+
+/* Receive the next frame of a multipart message, -1 if there is none */
+static int
+sdn_zmq_recv(zeromq *z, byte *buf, int size)
+{
+  int len;
+
+  if (!sdn_zmq_more(z) || ((len = zmq_recv(z->fd, buf, size, 0)) < 0))
+    return -1;
+  return MIN(len, size);
+}
+
+/*
+ * The same, but into @msg, however long the frame is. ZeroMQ puts
+ * a large frame in a buffer of its own, which the request is then
+ * parsed in, so a request is neither cut short nor copied. A frame
+ * longer than the request size is refused here, see init_zeromq().
+ */
+static int
+sdn_zmq_recv_msg(zeromq *z, zmq_msg_t *msg)
+{
+  struct proto *p = z->data;
+
+  if (!sdn_zmq_more(z) || (zmq_msg_recv(msg, z->fd, 0) < 0) ||
+      (zmq_msg_size(msg) > (size_t) P_CF->request_size))
+    return -1;
+  return zmq_msg_size(msg);
+}
+
+/*
+ * Anti-entropy
+ *
+ * A controller compares its copy of the shadow table with ours by
+ * walking the hash tree (see merkle.c) from the root down.
+ * <SDN_DIGEST> {"table" : T, "node" : N, "depth" : D} returns the
+ * digests of the descendants of node N which are D levels below it
+ * (just the root of the main table if the body is left out), together
+ * with the prefix range each of them covers. The controller descends
+ * only where the digests differ; once a range is small enough,
+ * <SDN_RANGE> {"table" : T, "node" : N} returns all routes in it. Both
+ * replies carry the sequence number of the table they show.
+ */
+
+#define SDN_DIGEST_DEPTH	8	/* Most levels returned at once */
+#define SDN_RANGE_MAX		65536	/* Most routes returned at once */
+
+static inline int
+sdn_merkle_depth(unsigned n)
+{
+  int d = 0;
+
+  while (n >>= 1)
+    d++;
+  return d;
+}
+
+/* First address of the range covered by node @n at depth @d */
+static ip_addr
+sdn_merkle_range(unsigned n, int d)
+{
+  u32 top = d ? (n - (1 << d)) << (32 - d) : 0;
+
+#ifndef IPV6
+  return ipa_from_u32(top);
+#else
+  return ipa_build(top, 0, 0, 0);
+#endif
+}
+
+/* Parse a tree node request, the table is -1 if not given */
+static int
+sdn_parse_node(char *msg, int len, int *table, int *root, int *depth)
+{
+  struct sdn_parser pr = { msg, msg + len };
+  char *key;
+  int klen, n = 0, res;
+
+  *table = -1;
+  *root = 1;
+  *depth = 0;
+
+  sdn_parse_ws(&pr);
+  if (pr.pos == pr.end)
+    return 1;
+  if (!sdn_parse_char(&pr, '{'))
+    return 0;
+  while ((res = sdn_parse_member(&pr, &n, &key, &klen)) > 0)
+    {
+      if (SDN_KEY(key, klen, "table"))
+	res = sdn_parse_int(&pr, table);
+      else if (SDN_KEY(key, klen, "node"))
+	res = sdn_parse_int(&pr, root);
+      else if (SDN_KEY(key, klen, "depth"))
+	res = sdn_parse_int(&pr, depth);
+      else
+	res = sdn_parse_skip(&pr);
+      if (!res)
+	return 0;
+    }
+  return !res && (*root >= 1) && (*root < 2 * SDN_MERKLE_LEAVES) && (*depth >= 0);
+}
+
+static void
+sdn_digest(struct proto *p, zeromq *z, byte *id, int idlen, int delim, char *msg, int len)
+{
+  struct sdn_table *t;
+  struct sdn_merkle *m;
+  int table, root, depth, d, i, pos;
+  unsigned c;
+  char *buf;
+
+  if (!sdn_parse_node(msg, len, &table, &root, &depth))
+    {
+      log(L_REMOTE "%s: Malformed digest request from controller", p->name);
+      sdn_client_status(z, id, idlen, delim, "<SDN_DIGEST>", "error");
+      return;
+    }
+
+  if (!(t = (table < 0) ? HEAD(P->tables) : sdn_table_find_id(p, table)))
+    {
+      sdn_client_status(z, id, idlen, delim, "<SDN_DIGEST>", "unknown table");
+      return;
+    }
+
+  /* Compact tables have no hash tree to compare */
+  if (P_CF->compact)
+    {
+      sdn_client_status(z, id, idlen, delim, "<SDN_DIGEST>", "not available");
+      return;
+    }
+  m = &t->merkle;
+
+  d = sdn_merkle_depth(root);
+  depth = MIN(depth, MIN(SDN_DIGEST_DEPTH, SDN_MERKLE_BITS - d));
+  d += depth;
+
+  buf = xmalloc(128 + (SDN_RECORD_MAX << depth));
+  pos = bsprintf(buf, "<SDN_DIGEST> {\"status\" : \"ok\", \"seq\" : %lu, \"table\" : %u, \"digests\" : [",
+		 (unsigned long) P->seq, t->id);
+  for (i = 0; i < (1 << depth); i++)
+    {
+      c = (root << depth) + i;
+      pos += bsprintf(buf + pos, "%s{\"node\" : %u, \"prefix\" : \"%I\", \"mask\" : %d, \"hash\" : \"%08x%08x\", \"count\" : %u}",
+		      i ? ", " : "", c, sdn_merkle_range(c, d), d,
+		      (u32) (m->hash[c] >> 32), (u32) m->hash[c], m->count[c]);
+    }
+  pos += bsprintf(buf + pos, "]}\n");
+
+  sdn_client_reply(z, id, idlen, delim, buf, pos);
+  free(buf);
+}
+
+static void
+sdn_range(struct proto *p, zeromq *z, byte *id, int idlen, int delim, char *msg, int len)
+{
+  struct sdn_table *t;
+  struct sdn_merkle *m;
+  struct sdn_entry *e;
+  int table, root, depth, d, pos, n = 0;
+  unsigned l, first, last;
+  node *x;
+  char *buf;
+
+  if (!sdn_parse_node(msg, len, &table, &root, &depth))
+    {
+      log(L_REMOTE "%s: Malformed range request from controller", p->name);
+      sdn_client_status(z, id, idlen, delim, "<SDN_RANGE>", "error");
+      return;
+    }
+
+  if (!(t = (table < 0) ? HEAD(P->tables) : sdn_table_find_id(p, table)))
+    {
+      sdn_client_status(z, id, idlen, delim, "<SDN_RANGE>", "unknown table");
+      return;
+    }
+
+  /* Compact tables have no hash tree to compare */
+  if (P_CF->compact)
+    {
+      sdn_client_status(z, id, idlen, delim, "<SDN_RANGE>", "not available");
+      return;
+    }
+  m = &t->merkle;
+
+  if (m->count[root] > SDN_RANGE_MAX)
+    {
+      sdn_client_status(z, id, idlen, delim, "<SDN_RANGE>", "too big");
+      return;
+    }
+
+  d = sdn_merkle_depth(root);
+  first = (root << (SDN_MERKLE_BITS - d)) - SDN_MERKLE_LEAVES;
+  last = first + (1 << (SDN_MERKLE_BITS - d));
+
+  buf = xmalloc(256 + m->count[root] * SDN_RECORD_MAX);
+  pos = bsprintf(buf, "<SDN_RANGE> {\"status\" : \"ok\", \"seq\" : %lu, \"table\" : %u, \"node\" : %d, \"hash\" : \"%08x%08x\", \"routes\" : [",
+		 (unsigned long) P->seq, t->id, root, (u32) (m->hash[root] >> 32), (u32) m->hash[root]);
+  for (l = first; l < last; l++)
+    WALK_LIST(x, m->leaf[l])
+      {
+	e = SDN_EXT_ENTRY(SKIP_BACK(struct sdn_entry_ext, leaf, x));
+	pos += sdn_format_route(p, buf + pos, n++, e);
+      }
+  pos += bsprintf(buf + pos, "]}\n");
+
+  TRACE(D_EVENTS, "Sent %d routes of range %I/%d", n, sdn_merkle_range(root, d), d);
+  sdn_client_reply(z, id, idlen, delim, buf, pos);
+  free(buf);
+}
+
+/*
+ * Records of multipath routes carry just the number of their next hop
+ * group. <SDN_GROUPS> returns the definitions of all groups in use, in
+ * the same shape as the <SDN_GROUP> messages RheaFlow gets.
+ */
+static void
+sdn_groups(struct proto *p, zeromq *z, byte *id, int idlen, int delim)
+{
+  struct sdn_nexthops *t = &P->nexthops;
+  struct sdn_group *g;
+  uint size = 128;
+  char *buf, *pos;
+  int n = 0;
+  u32 i;
+
+  for (i = 1; i < t->used; i++)
+    if (t->nh[i].uses && (g = t->nh[i].group))
+      size += 2 + SDN_GROUP_SIZE(g->count);
+
+  buf = xmalloc(size);
+  pos = buf + bsprintf(buf, "<SDN_GROUPS> {\"status\" : \"ok\", \"groups\" : [");
+  for (i = 1; i < t->used; i++)
+    if (t->nh[i].uses && (g = t->nh[i].group))
+      {
+	if (n++)
+	  pos = SDN_PUT(pos, ", ");
+	pos = sdn_put_group(pos, i, g);
+      }
+  pos = SDN_PUT(pos, "]}\n");
+
+  sdn_client_reply(z, id, idlen, delim, buf, pos - buf);
+  free(buf);
+}
+
+#define SDN_REQ_PUSH	"<SDN_PUSH>"
+#define SDN_REQ_DIGEST	"<SDN_DIGEST>"
+#define SDN_REQ_RANGE	"<SDN_RANGE>"
+#define SDN_REQ_SUBSCRIBE	"<SDN_SUBSCRIBE>"
+#define SDN_REQ_GROUPS	"<SDN_GROUPS>"
+
+#define SDN_REQ(msg, len, tag) (((len) >= (int) sizeof(tag) - 1) && !memcmp(msg, tag, sizeof(tag) - 1))
+
+static int
+zeromq_rx(zeromq *z, int size)
+{
+  struct proto *p;
+  byte id[SDN_ID_MAX];
+  char reply[128];
+  zmq_msg_t body;
+  char *msg;
+  int idlen, delim = 0, len, hl;
+  p = z->data;
+
+  /*
+   * The first frame is the identity of the client and the last one is
+   * the request. REQ clients put an empty delimiter between them, so
+   * an empty frame is the delimiter only if another one follows it.
+   */
+  idlen = MIN(size, SDN_ID_MAX);
+  memcpy(id, z->rbuf, idlen);
+
+  zmq_msg_init(&body);
+  len = sdn_zmq_recv_msg(z, &body);
+  if (!len && sdn_zmq_more(z))
+    {
+      delim = 1;
+      len = sdn_zmq_recv_msg(z, &body);
+    }
+  while (sdn_zmq_recv(z, NULL, 0) >= 0)
+    ;
+  if (len < 0)
+    {
+      log(L_REMOTE "%s: Empty request from controller", p->name);
+      zmq_msg_close(&body);
+      return 0;
+    }
+
+  msg = zmq_msg_data(&body);
+  log_msg(L_DEBUG "got %d byte request on socket", len);
+
+  if (SDN_REQ(msg, len, SDN_REQ_PUSH))
+  {
+    hl = strlen(SDN_REQ_PUSH);
+    len = sdn_push(p, msg + hl, len - hl, reply, sizeof(reply));
+    sdn_client_reply(z, id, idlen, delim, reply, len);
+  }
+  else if (SDN_REQ(msg, len, SDN_REQ_DIGEST))
+  {
+    hl = strlen(SDN_REQ_DIGEST);
+    sdn_digest(p, z, id, idlen, delim, msg + hl, len - hl);
+  }
+  else if (SDN_REQ(msg, len, SDN_REQ_RANGE))
+  {
+    hl = strlen(SDN_REQ_RANGE);
+    sdn_range(p, z, id, idlen, delim, msg + hl, len - hl);
+  }
+  else if (SDN_REQ(msg, len, SDN_REQ_SUBSCRIBE))
+  {
+    hl = strlen(SDN_REQ_SUBSCRIBE);
+    sdn_subscribe(p, z, id, idlen, delim, msg + hl, len - hl);
+  }
+  else if (SDN_REQ(msg, len, SDN_REQ_GROUPS))
+    sdn_groups(p, z, id, idlen, delim);
+  else
+    /* Anything else is a dump request */
+    sdn_dump_start(p, z, id, idlen, delim);
+
+  zmq_msg_close(&body);
+  return 0;
+}
+
+static int
+unix_rx(sock *s, int size UNUSED)
+{
+  struct proto *p;
+  struct sdn_entry *entry;
+  struct sdn_table *t;
+  char* outbuffer = NULL;
+  //char* routestring = "<SDN_DUMP> [%s]\n";
+  //char* perroutestring = "{\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}";
+  char *pos;
+  //char* addedstring = "<SDN_ANNOUNCE> {\"added\" : [{\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}] }\n";
+  log_msg(L_DEBUG "got packet on socket");
+  p = s->data;
+  WALK_LIST( t, P->tables )
+  FIB_WALK( &t->fib, e ) {
+    entry = (struct sdn_entry*) e;
+    if (entry->n.flags & SEF_DELETED)
+      continue;
+    outbuffer = xmalloc(SDN_RECORD_MAX);
+    pos = SDN_PUT(outbuffer, "<SDN_DUMP> ");
+    pos = sdn_put_record(p, pos, t->id, entry->n.prefix, entry->n.pxlen, entry->nh);
+    pos = SDN_PUT(pos, "\n");
+    *pos = 0;
+    sdn_route_print_to_sockets(p, outbuffer);
+    free(outbuffer);
+  } FIB_WALK_END;
+  // send stuff back to garyland
+  //s->tbuf = "gary";
+  //sk_send(s, 5);
+  return 0;
+}
+
+static void
+unix_err(sock *s, int err UNUSED)
+{
+  log_msg(L_ERR "got error on socket");
+}
+
+static int
+unix_connect(sock *s, int size UNUSED)
+{
+  struct proto *p=NULL;
+  struct proto_config *pc;
+  log_msg(L_DEBUG "someone connected to our socket");
+  WALK_LIST(pc, config->protos){
+    if (pc->protocol == &proto_sdn && pc->proto){
+      log_msg(L_DEBUG "this is the droid we're looking for");
+      p = pc->proto;
+    }
+    log_msg(L_DEBUG "gary");
+  }
+  if(!p) return 0;
+  s->rx_hook = unix_rx;
+  s->tx_hook = unix_tx;
+  s->type = SK_MAGIC;
+  s->err_hook = unix_err;
+  s->data = p;
+  //s->pool = c->pool;            /* We need to have all the socket buffers allocated in the cli pool */
+  //c->rx_pos = c->rx_buf;
+  //c->rx_aux = NULL;
+  //rmove(s, c->pool);
+  // add socket to pool
+  CHK_MAGIC;
+  //add_head( &P->sockets, NODE s );
+  //sk_insert(s);
   return 1;
 }
 
 static zeromq*
 init_zeromq(struct proto *p)
 {
-  zeromq *z;
-  //char* socketname = (P_CF->unixsocket?P_CF->unixsocket:"/tmp/sdn.sock");
-  char* url = "tcp://127.0.0.1:5556";
-  log_msg(L_DEBUG "Using URL\n", url);
+  zeromq *z;
+  int mandatory = 1;
+  s64 maxsize = P_CF->request_size;
+  //char* socketname = (P_CF->unixsocket?P_CF->unixsocket:"/tmp/sdn.sock");
+  char* url = P_CF->zeromq;
+  log_msg(L_DEBUG "Using URL %s\n", url);
+
+  z = zq_new(p->pool);
+  z->type = ZMQ_ROUTER;
+  z->url = xmalloc(strlen(url)+1);
+  strcpy(z->url, url);
+  //s->rx_hook = unix_connect;
+  z->rx_hook = sdn_timed_zmq_rx;
+  /* Just the identity frame goes here, see zeromq_rx() */
+  z->rbsize = SDN_ID_MAX;
+  // need to set proper rbuf, rbsize etc 
+  //if (!s->rbuf && s->rbsize)
+      z->rbuf = z->rbuf_alloc = xmalloc(z->rbsize);
+      z->rpos = z->rbuf;
+      if (!z->tbuf && z->tbsize)
+          z->tbuf = z->tbuf_alloc = xmalloc(z->tbsize);
+      z->tpos = z->ttx = z->tbuf;
+  //}
+  z->data = p;
+
+  //unlink(socketname);
+
+  if(zq_open(z) < 0){
+    log(L_ERR "%s: Cannot open ZeroMQ endpoint %s, running without it", p->name, url);
+    rfree(z);
+    return NULL;
+  }
+
+  /*
+   * zq_open() binds the socket as it opens it, so the options are set
+   * right after. libzmq may have handed the old message size limit to
+   * the listener by then, thus sdn_zmq_recv_msg() checks it as well.
+   */
+  if ((zmq_setsockopt(z->fd, ZMQ_ROUTER_MANDATORY, &mandatory, sizeof(mandatory)) < 0) ||
+      (zmq_setsockopt(z->fd, ZMQ_MAXMSGSIZE, &maxsize, sizeof(maxsize)) < 0)){
+    log(L_ERR "%s: Cannot set up ZeroMQ endpoint %s: %s, running without it",
+	p->name, url, zmq_strerror(zmq_errno()));
+    rfree(z);
+    return NULL;
+  }
+  CHK_MAGIC;
+  //add_head( &P->sockets, NODE s );
+  return z;
+}
+
+static sock*
+init_unix_socket(struct proto *p)
+{
+  sock *s;
+  char* socketname = (P_CF->unixsocket?P_CF->unixsocket:"/tmp/sdn.sock");
+  log_msg(L_DEBUG "Socket in config is %s\n", P_CF->unixsocket);
+
+  s = sk_new(p->pool);
+  s->type = SK_UNIX;
+  //s->rx_hook = unix_connect;
+  s->rx_hook = unix_rx;
+  s->rbsize = 1024;
+  // need to set proper rbuf, rbsize etc 
+  //if (!s->rbuf && s->rbsize)
+      s->rbuf = s->rbuf_alloc = xmalloc(s->rbsize);
+      s->rpos = s->rbuf;
+      if (!s->tbuf && s->tbsize)
+          s->tbuf = s->tbuf_alloc = xmalloc(s->tbsize);
+      s->tpos = s->ttx = s->tbuf;
+  //}
+  s->data = p;
+
+  //unlink(socketname);
+
+  if(sk_open_unix_connect(s, socketname) < 0){
+    die("Cannot open socket");
+  }
+  CHK_MAGIC;
+  //add_head( &P->sockets, NODE s );
+  return s;
+}
+
+/**
+ * new_iface
+ * @p: myself
+ * @new: interface to be created or %NULL if we are creating a magic
+ * socket. The magic socket is used for listening and also for
+ * sending requested responses.
+ * @flags: interface flags
+ * @patt: pattern this interface matched, used for access to config options
+ *
+ * Create an interface structure and start listening on the interface.
+ */
+
+
+// new_iface(struct proto *p, struct iface *new, unsigned long flags, struct iface_patt *patt )
+//static sock *
+//new_listening_iface(ip_addr addr, unsigned port, u32 flags)
+//static sock *
+static struct sdn_interface*
+new_iface(struct proto *p, struct iface *new, unsigned long flags, struct iface_patt *patt )
+{
+  struct sdn_interface *rif;
+  struct sdn_patt *PATT = (struct sdn_patt *) patt;
+  rif = mb_allocz(p->pool, sizeof( struct sdn_interface ));
+  rif->iface = new;
+  rif->proto = p;
+  rif->busy = NULL;
+  if (PATT) {
+    rif->mode = PATT->mode;
+    rif->metric = PATT->metric;
+    rif->multicast = (!(PATT->mode & IM_BROADCAST)) && (flags & IF_MULTICAST);
+    //rif->check_ttl = (PATT->ttl_security == 1);
+  }
+  /* lookup multicasts over unnumbered links - no: rip is not defined over unnumbered links */
+
+  if (rif->multicast)
+    DBG( "Doing multicasts!\n" );
+
+  rif->sock = sk_new( p->pool );
+  rif->sock->type = SK_UDP;
+  rif->sock->sport = P_CF->port;
+  rif->sock->rx_hook = sdn_rx;
+  rif->sock->data = rif;
+  rif->sock->rbsize = 10240;
+  rif->sock->iface = new;		/* Automagically works for dummy interface */
+  rif->sock->tbuf = mb_alloc( p->pool, sizeof( struct sdn_packet ));
+  rif->sock->tx_hook = sdn_tx;
+  rif->sock->err_hook = sdn_tx_err;
+  rif->sock->daddr = IPA_NONE;
+  rif->sock->dport = P_CF->port;
+  if (new)
+    {
+      rif->sock->tos = PATT->tx_tos;
+      rif->sock->priority = PATT->tx_priority;
+      rif->sock->ttl = PATT->ttl_security ? 255 : 1;
+      // rif->sock->flags = SKF_LADDR_RX | (rif->check_ttl ? SKF_TTL_RX : 0);
+    }
+
+  if (new) {
+    if (new->addr->flags & IA_PEER)
+      log( L_WARN "%s: sdn is not defined over unnumbered links", p->name );
+    if (rif->multicast) {
+#ifndef IPV6
+      rif->sock->daddr = ipa_from_u32(0xe0000009);
+#else
+      rif->sock->daddr = ipa_build(0xff020000, 0, 0, 9);
+#endif
+    } else {
+      rif->sock->daddr = new->addr->brd;
+    }
+  }
+
+  if (!ipa_nonzero(rif->sock->daddr)) {
+    if (rif->iface)
+      log( L_WARN "%s: interface %s is too strange for me", p->name, rif->iface->name );
+  } else {
+
+    if (sk_open(rif->sock) < 0)
+      goto err;
+
+    if (rif->multicast)
+      {
+	if (sk_setup_multicast(rif->sock) < 0)
+	  goto err;
+	if (sk_join_group(rif->sock, rif->sock->daddr) < 0)
+	  goto err;
+      }
+    else
+      {
+	if (sk_setup_broadcast(rif->sock) < 0)
+	  goto err;
+      }
+  }
+
+  TRACE(D_EVENTS, "Listening on %s, port %d, mode %s (%I)", rif->iface ? rif->iface->name : "(dummy)", P_CF->port, rif->multicast ? "multicast" : "broadcast", rif->sock->daddr );
+  
+  return rif;
+
+ err:
+  sk_log_error(rif->sock, p->name);
+  log(L_ERR "%s: Cannot open socket for %s", p->name, rif->iface ? rif->iface->name : "(dummy)" );
+  if (rif->iface) {
+    rfree(rif->sock);
+    mb_free(rif);
+    return NULL;
+  }
+  /* On dummy, we just return non-working socket, so that user gets error every time anyone requests table */
+  return rif;
+
+}
+
+/*static struct sdn_interface *
+new_iface(struct proto *p, struct iface *new, unsigned long flags, struct iface_patt *patt )
+{
+  struct sdn_interface *rif;
+  struct sdn_patt *PATT = (struct sdn_patt *) patt;
+
+  rif = mb_allocz(p->pool, sizeof( struct sdn_interface ));
+  rif->iface = new;
+  rif->proto = p;
+  rif->busy = NULL;
+  if (PATT) {
+    rif->mode = PATT->mode;
+    rif->metric = PATT->metric;
+    rif->multicast = (!(PATT->mode & IM_BROADCAST)) && (flags & IF_MULTICAST);
+  }
+
+  if (rif->multicast)
+    DBG( "Doing multicasts!\n" );
+
+  rif->sock = sk_new( p->pool );
+  rif->sock->type = SK_UDP;
+  rif->sock->sport = P_CF->port;
+  rif->sock->rx_hook = sdn_rx;
+  rif->sock->data = rif;
+  rif->sock->rbsize = 10240;
+  rif->sock->iface = new;		// Automagically works for dummy interface
+  rif->sock->tbuf = mb_alloc( p->pool, sizeof( struct sdn_packet ));
+  rif->sock->tx_hook = sdn_tx;
+  rif->sock->err_hook = sdn_tx_err;
+  rif->sock->daddr = IPA_NONE;
+  rif->sock->dport = P_CF->port;
+  if (new)
+    {
+      rif->sock->ttl = 1;
+      rif->sock->tos = IP_PREC_INTERNET_CONTROL;
+      rif->sock->flags = SKF_LADDR_RX;
+    }
+
+  if (new) {
+    if (new->addr->flags & IA_PEER)
+      log( L_WARN "%s: sdn is not defined over unnumbered links", p->name );
+    rif->sock->saddr = IPA_NONE;
+    if (rif->multicast) {
+#ifndef IPV6
+      rif->sock->daddr = ipa_from_u32(0xe0000009);
+#else
+      rif->sock->daddr = ipa_build(0xff020000, 0, 0, 9);
+#endif
+    } else {
+      rif->sock->daddr = new->addr->brd;
+    }
+    rif->sock->daddr = ipa_from_u32(0x00000000);
+  }
+  if (!ipa_nonzero(rif->sock->daddr)) {
+    if (rif->iface)
+      log( L_WARN "%s: interface %s is too strange for me", p->name, rif->iface->name );
+  } else { 
+
+    if (sk_open(rif->sock) < 0)
+      goto err;
+
+    if (rif->multicast)
+      {
+	if (sk_setup_multicast(rif->sock) < 0)
+	  goto err;
+	if (sk_join_group(rif->sock, rif->sock->daddr) < 0)
+	  goto err;
+      }
+    else
+      {
+	if (sk_setup_broadcast(rif->sock) < 0)
+	  goto err;
+      }
+  }
+
+  TRACE(D_EVENTS, "Listening on %s, port %d, mode %s (%I)", rif->iface ? rif->iface->name : "(dummy)", P_CF->port, rif->multicast ? "multicast" : "broadcast", rif->sock->daddr );
+  
+  return rif;
+
+ err:
+  sk_log_error(rif->sock, p->name);
+  log_msg(L_ERR "Error opening socket on %s", rif->iface);
+  log(L_ERR "%s: Cannot open socket for %s", p->name, rif->iface ? rif->iface->name : "(dummy)" );
+  if (rif->iface) {
+    rfree(rif->sock);
+    mb_free(rif);
+    return NULL;
+  }
+  // On dummy, we just return non-working socket, so that user gets error every time anyone requests table
+  return rif;
+}*/
+
+static void
+sdn_real_if_add(struct object_lock *lock)
+{
+  struct iface *iface = lock->iface;
+  struct proto *p = lock->data;
+  struct sdn_interface *rif;
+  struct iface_patt *k = iface_patt_find(&P_CF->iface_list, iface, iface->addr);
+
+  if (!k)
+    bug("This can not happen! It existed few seconds ago!" );
+  log_msg(L_DEBUG "adding interface %s", iface->name);
+  DBG("adding interface %s\n", iface->name );
+  rif = new_iface(p, iface, iface->flags, k);
+  if (rif) {
+    sdn_iface_link(p, rif);
+    DBG("Adding object lock of %p for %p\n", lock, rif);
+    log_msg(L_DEBUG "Adding object lock of %p for %p\n", lock, rif);
+    rif->lock = lock;
+  } else { rfree(lock); }
+}
+
+static void
+sdn_if_notify(struct proto *p, unsigned c, struct iface *iface)
+{
+  DBG( "sdn: if notify\n" );
+  log_msg(L_DEBUG "Calling sdn_if_notify for if: %s", iface->name);
+  if (iface->flags & IF_IGNORE){
+    log_msg(L_DEBUG "Ignoring if %s", iface->name);
+    return;
+  }
+  if (c & IF_CHANGE_DOWN) {
+    struct sdn_interface *i;
+    log_msg(L_DEBUG "Interface %s going down", iface->name);
+    i = find_interface(p, iface);
+    if (i) {
+      sdn_iface_unlink(p, i);
+      if (i->lock)
+	rfree(i->lock);
+      kill_iface(i);
+      sdn_shared_update(p);
+    }
+  }
+  if (c & IF_CHANGE_UP) {
+    struct iface_patt *k = iface_patt_find(&P_CF->iface_list, iface, iface->addr);
+    struct object_lock *lock;
+    struct sdn_patt *PATT = (struct sdn_patt *) k;
+
+    log_msg(L_DEBUG "Interface %s going up", iface->name);
+
+    if (!k) {
+      log_msg(L_DEBUG "Not interested in interface %s", iface->name);
+      return; /* We are not interested in this interface */
+    }
+
+    if (P_CF->shared_socket) {
+      sdn_shared_if_add(p, iface, k);
+      return;
+    }
+
+    lock = olock_new( p->pool );
+    if (!(PATT->mode & IM_BROADCAST) && (iface->flags & IF_MULTICAST)){
+      log_msg(L_DEBUG "multicast and broadcast flags");
+#ifndef IPV6
+      lock->addr = ipa_from_u32(0xe0000009);
+#else
+      ip_pton("FF02::9", &lock->addr);
+#endif
+    }
+    else {
+      log_msg(L_DEBUG "not multicast/broadcast flags");
+      lock->addr = iface->addr->brd;
+    }
+    lock->port = P_CF->port;
+    lock->iface = iface;
+    lock->hook = sdn_real_if_add;
+    lock->data = p;
+    lock->type = OBJLOCK_UDP;
+    olock_acquire(lock);
+  }
+}
+
+/*
+ * Temporary attributes
+ *
+ * Filters see the metric and tag of our routes as temporary attributes.
+ * Each route needs a list of its own: the core links lists of temporary
+ * attributes to others in place, e.g. rt_show_rte() appends the route
+ * attributes to them, so a list shared by routes would not stay ours.
+ */
+
+static struct ea_list *
+sdn_gen_attrs(struct linpool *pool, int metric, u16 tag)
+{
+  struct ea_list *l = lp_alloc(pool, sizeof(struct ea_list) + 2*sizeof(eattr));
+
+  l->next = NULL;
+  l->flags = EALF_SORTED;
+  l->count = 2;
+  l->attrs[0].id = EA_SDN_TAG;
+  l->attrs[0].flags = 0;
+  l->attrs[0].type = EAF_TYPE_INT | EAF_TEMP;
+  l->attrs[0].u.data = tag;
+  l->attrs[1].id = EA_SDN_METRIC;
+  l->attrs[1].flags = 0;
+  l->attrs[1].type = EAF_TYPE_INT | EAF_TEMP;
+  l->attrs[1].u.data = metric;
+  return l;
+}
+
+/*
+ * Routes of other protocols are accepted without running the export
+ * filter, so nothing would ever look at attributes given to them here;
+ * sdn_rt_notify() takes the tag as 0 when it is missing.
+ */
+static int
+sdn_import_control(struct proto *p, struct rte **rt, struct ea_list **attrs UNUSED, struct linpool *pool UNUSED)
+{
+  if ((*rt)->attrs->src->proto == p)	/* My own must not be touched */
+    return 1;
+
+  return (*rt)->attrs->source != RTS_SDN;
+}
+
+static struct ea_list *
+sdn_make_tmp_attrs(struct rte *rt, struct linpool *pool)
+{
+  return sdn_gen_attrs(pool, rt->u.sdn.metric, rt->u.sdn.tag);
+}
+
+static void
+sdn_store_tmp_attrs(struct rte *rt, struct ea_list *attrs)
+{
+  rt->u.sdn.tag = ea_get_int(attrs, EA_SDN_TAG, 0);
+  rt->u.sdn.metric = ea_get_int(attrs, EA_SDN_METRIC, 1);
+}
+
+static void sdn_route_print_to_sockets(struct proto* p, char* route)
+{
+  struct sdn_unix_socket_wrapper *swrapper=NULL;
+  WALK_LIST(swrapper, P->sockets){
+    log_msg(L_DEBUG "printing out to socket %X", swrapper->skt->type);
+    swrapper->skt->tbuf=route;
+    sk_send(swrapper->skt, strlen(route));
+  }
+}
+
+/*
+ * Controller connection
+ *
+ * All tables share one connection to each RheaFlow instance, which gets
+ * the routes assigned to it by the controller ring (see ring.c). Each
+ * connection has its own batches, retries and counters, and is opened
+ * in the background, so the protocol comes up at once whether the controller
+ * is there or not. A failed attempt is retried after SDN_CTL_RETRY_MIN
+ * seconds, the delay doubling with every further failure up to
+ * SDN_CTL_RETRY_MAX. Nothing is queued while we are not connected: the
+ * shadow tables already hold the coalesced result of all the changes
+ * RheaFlow has missed, so once connected it gets a snapshot of its
+ * routes, and the incremental announcements follow.
+ *
+ * Changes are not written out one at a time: they are encoded into a
+ * batch buffer, consecutive records of the same kind sharing one
+ * <SDN_ANNOUNCE> message, and the batch is handed to the socket by an
+ * event when the core is done with the current round of updates, or
+ * earlier if the buffer fills up. While the socket is still writing
+ * out one batch, the next one grows in the other buffer. Should it grow
+ * past SDN_BATCH_MAX, it is dropped and replaced by a new snapshot as
+ * soon as the socket is free again.
+ */
+
+#define SDN_CTL_RETRY_MIN	1
+#define SDN_CTL_RETRY_MAX	64
+
+#define SDN_BATCH_ADDED		1
+#define SDN_BATCH_REMOVED	2
+
+static void sdn_ctl_snapshot(struct sdn_controller *c);
+
+static inline struct sdn_controller *
+sdn_ctl_of(struct proto *p, struct sdn_entry *e)
+{
+  if (P->ring.controllers == 1)
+    return P->ctl[P->ring.single];
+  return P->ctl[sdn_ring_owner(&P->ring, sdn_ring_hash(e->n.prefix, e->n.pxlen))];
+}
+
+static void
+sdn_batch_flush(struct sdn_controller *c)
+{
+  struct proto *p = c->proto;
+  char *buf;
+  int size, len;
+
+  if (c->open)
+    c->len += bsprintf(c->buf + c->len, "] }\n");
+  c->open = 0;
+
+  if (c->state != SDN_CTL_UP)
+    {
+      c->len = 0;
+      return;
+    }
+
+  /* sdn_ctl_tx() calls us again when the socket is done */
+  if (c->busy)
+    return;
+
+  if (c->resync)
+    sdn_ctl_snapshot(c);
+
+  if (!c->len)
+    return;
+
+  c->sent += c->len;
+  if (!c->sk)
+    {
+      /* Mock controller */
+      c->len = 0;
+      return;
+    }
+
+  /* The socket writes out this batch while the next one is filled in */
+  buf = c->out;
+  size = c->out_size;
+  c->out = c->buf;
+  c->out_size = c->size;
+  c->buf = buf;
+  c->size = size;
+  len = c->len;
+  c->len = 0;
+
+  TRACE(D_PACKETS, "Sending %d bytes to controller %s", len, c->cf->host);
+  c->busy = 1;
+  c->sk->tbuf = c->out;
+  if (sk_send(c->sk, len) > 0)
+    c->busy = 0;
+}
+
+static void
+sdn_batch_event(void *data)
+{
+  sdn_batch_flush(data);
+}
+
+/* Flush all batches, when there is no event loop to do it */
+static void
+sdn_batch_flush_all(struct proto *p)
+{
+  int i;
+
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    if (P->ctl[i])
+      sdn_batch_flush(P->ctl[i]);
+}
+
+/* Make room for @need more bytes, 0 if the batch had to be dropped */
+static int
+sdn_batch_room(struct sdn_controller *c, int need)
+{
+  struct proto *p = c->proto;
+
+  if (c->len + need <= c->size)
+    return 1;
+
+  sdn_batch_flush(c);
+  if (c->len + need <= c->size)
+    return 1;
+
+  if (c->size >= SDN_BATCH_MAX)
+    {
+      log(L_WARN "%s: Controller %s does not keep up, will send a snapshot instead", p->name, c->cf->host);
+      c->len = 0;
+      c->open = 0;
+      c->resync = 1;
+      return 0;
+    }
+
+  c->size *= 2;
+  c->buf = mb_realloc(c->buf, c->size);
+  return 1;
+}
+
+/*
+ * Records of multipath routes refer to their next hop group by number.
+ * RheaFlow learns what a group is from a <SDN_GROUP> message sent ahead
+ * of the first record using it, and just once, however many routes
+ * share the group.
+ */
+static void
+sdn_batch_group(struct sdn_controller *c, u32 id)
+{
+  struct proto *p = c->proto;
+  struct sdn_group *g = sdn_nh_group(&P->nexthops, id);
+  char *pos;
+
+  if (c->open)
+    c->len += bsprintf(c->buf + c->len, "] }\n");
+  c->open = 0;
+
+  if (!sdn_batch_room(c, SDN_GROUP_SIZE(g->count)))
+    return;
+
+  pos = SDN_PUT(c->buf + c->len, "<SDN_GROUP> ");
+  pos = sdn_put_group(pos, id, g);
+  *pos++ = '\n';
+  c->len = pos - c->buf;
+  g->told |= 1u << c->id;
+}
+
+/* Define all groups RheaFlow has not heard of yet */
+static void
+sdn_batch_groups(struct sdn_controller *c)
+{
+  struct proto *p = c->proto;
+  struct sdn_nexthops *t = &P->nexthops;
+  u32 i;
+
+  for (i = 1; i < t->used; i++)
+    if (t->nh[i].uses && t->nh[i].group && !(t->nh[i].group->told & (1u << c->id)))
+      sdn_batch_group(c, i);
+}
+
+/* Queue an announcement of the current state of @e, or its withdrawal, to @c */
+static void
+sdn_batch_add_to(struct sdn_controller *c, struct sdn_entry *e, int removed)
+{
+  struct proto *p = c->proto;
+  int kind = removed ? SDN_BATCH_REMOVED : SDN_BATCH_ADDED;
+  struct sdn_group *g = sdn_nh_group(&P->nexthops, e->nh);
+
+  /* The snapshot to come covers it */
+  if ((c->state != SDN_CTL_UP) || c->resync)
+    return;
+
+  if (g && !(g->told & (1u << c->id)))
+    sdn_batch_group(c, e->nh);
+
+  if (!sdn_batch_room(c, 2 * SDN_RECORD_MAX))
+    return;
+
+  if (c->open != kind)
+    {
+      if (c->open)
+	c->len += bsprintf(c->buf + c->len, "] }\n");
+      c->len += bsprintf(c->buf + c->len, "<SDN_ANNOUNCE> {\"%s\" : [", removed ? "removed" : "added");
+      c->open = kind;
+      c->count = 0;
+    }
+
+  c->len += sdn_format_route(p, c->buf + c->len, c->count++, e);
+  c->records++;
+  ev_schedule(c->flush);
+}
+
+/* The same to the controller @e belongs to */
+static inline void
+sdn_batch_add(struct proto *p, struct sdn_entry *e, int removed)
+{
+  sdn_batch_add_to(sdn_ctl_of(p, e), e, removed);
+}
+
+/*
+ * Programming status
+ *
+ * RheaFlow reports what became of the routes it was sent, one line
+ * each time, as <SDN_RESULT> {"installed" : [...], "rejected" : [...],
+ * "full" : [...]}, the routes in the same form as in the announcements.
+ * The outcome is kept in two bits of the flags of each shadow table
+ * entry, so it costs no memory beyond a few counters. Any change of a
+ * route makes it pending again until RheaFlow reports back.
+ *
+ * A route rejected or refused for lack of room in the flow table gets
+ * a retry record on the retry wheel and is announced again after
+ * SDN_RETRY_MIN seconds, then after twice as long each time up to
+ * SDN_RETRY_MAX, until RheaFlow installs it, or it is changed or
+ * withdrawn. A snapshot makes all routes pending again, so it needs no
+ * retries on top of it.
+ */
+
+#define SDN_RETRY_MIN		2
+#define SDN_RETRY_MAX		256
+
+#define SDN_REPLY_RESULT	"<SDN_RESULT>"
+
+static void
+sdn_retry_add(struct proto *p, struct sdn_entry *e)
+{
+  struct sdn_retry *r;
+
+  if (e->n.flags & SEF_RETRY)
+    return;
+
+  r = sl_alloc(P->retry_slab);
+  r->e = e;
+  r->tries = 0;
+  r->when = now + SDN_RETRY_MIN;
+  sdn_wheel_add(&P->retry, &r->n, r->when);
+  e->n.flags |= SEF_RETRY;
+}
+
+static bird_clock_t
+sdn_retry_expires(struct sdn_wheel *w, node *n)
+{
+  return ((struct sdn_retry *) n)->when;
+}
+
+static void
+sdn_retry_expire(struct sdn_wheel *w, node *n)
+{
+  struct proto *p = w->data;
+  struct sdn_controller *c;
+  struct sdn_retry *r = (struct sdn_retry *) n;
+  struct sdn_entry *e = r->e;
+  int status = e->n.flags & SEF_STATUS;
+
+  if (!sdn_entry_exported(e, P->budget.limit, !P_CF->compact) || ((status != SEF_REJECTED) && (status != SEF_FULL)))
+    {
+      sdn_wheel_remove(w, n);
+      sl_free(P->retry_slab, r);
+      e->n.flags &= ~SEF_RETRY;
+      sdn_entry_gc(p, e);
+      return;
+    }
+
+  /* The status stays as it is until RheaFlow reports back again */
+  c = sdn_ctl_of(p, e);
+  if ((c->state == SDN_CTL_UP) && !c->resync && !P->syncing)
+    {
+      sdn_batch_add_to(c, e, 0);
+      P->retried++;
+      r->tries++;
+    }
+
+  r->when = now + MIN(SDN_RETRY_MIN << MIN(r->tries, 8), SDN_RETRY_MAX);
+  sdn_wheel_update(w, n, r->when);
+}
+
+/* RheaFlow starts over from a snapshot, so does what it has told us */
+static void
+sdn_status_reset(struct sdn_controller *c)
+{
+  struct proto *p = c->proto;
+  struct sdn_table *t;
+  struct sdn_entry *e;
+
+  if (!P->status_count[1] && !P->status_count[2] && !P->status_count[3])
+    return;
+
+  WALK_LIST(t, P->tables)
+    {
+      FIB_WALK(&t->fib, fn)
+	{
+	  e = (struct sdn_entry *) fn;
+	  if ((e->n.flags & SEF_STATUS) && (sdn_ctl_of(p, e) == c))
+	    sdn_entry_status(p, e, SEF_PENDING);
+	}
+      FIB_WALK_END;
+    }
+}
+
+static int
+sdn_status_list(struct proto *p, struct sdn_parser *pr, int status, int *count)
+{
+  struct sdn_route_req r;
+  struct sdn_table *t;
+  struct sdn_entry *e;
+  int n = 0, res;
+
+  if (!sdn_parse_char(pr, '['))
+    return 0;
+  while ((res = sdn_parse_element(pr, &n)) > 0)
+    {
+      if (!sdn_parse_route(pr, &r))
+	return 0;
+
+      if (!(t = (r.table < 0) ? HEAD(P->tables) : sdn_table_find_id(p, r.table)))
+	continue;
+      if ((r.pxlen < 0) || (r.pxlen > BITS_PER_IP_ADDRESS))
+	continue;
+
+      /* Skip routes withdrawn or moved to another next hop since */
+      e = fib_find(&t->fib, &r.prefix, r.pxlen);
+      if (!e || (e->n.flags & SEF_DELETED))
+	continue;
+      if (ipa_nonzero(r.via) && !sdn_nh_group(&P->nexthops, e->nh) &&
+	  !ipa_equal(r.via, sdn_entry_nexthop(p, e)))
+	continue;
+
+      sdn_entry_status(p, e, status);
+      if (status != SEF_INSTALLED)
+	sdn_retry_add(p, e);
+      (*count)++;
+    }
+  return !res;
+}
+
+static void
+sdn_ctl_reply(struct sdn_controller *c, char *msg, int len)
+{
+  struct proto *p = c->proto;
+  struct sdn_parser pr = { msg, msg + len };
+  int count[4] = { 0, 0, 0, 0 };
+  char *key;
+  int klen, n = 0, res;
+
+  if (!SDN_REQ(msg, len, SDN_REPLY_RESULT))
+    {
+      TRACE(D_PACKETS, "Controller %s says: %.*s", c->cf->host, MIN(len, 80), msg);
+      return;
+    }
+  pr.pos += sizeof(SDN_REPLY_RESULT) - 1;
+
+  if (!sdn_parse_char(&pr, '{'))
+    res = -1;
+  else
+    while ((res = sdn_parse_member(&pr, &n, &key, &klen)) > 0)
+      {
+	if (SDN_KEY(key, klen, "installed"))
+	  res = sdn_status_list(p, &pr, SEF_INSTALLED, &count[SEF_INSTALLED >> 2]);
+	else if (SDN_KEY(key, klen, "rejected"))
+	  res = sdn_status_list(p, &pr, SEF_REJECTED, &count[SEF_REJECTED >> 2]);
+	else if (SDN_KEY(key, klen, "full"))
+	  res = sdn_status_list(p, &pr, SEF_FULL, &count[SEF_FULL >> 2]);
+	else
+	  res = sdn_parse_skip(&pr);
+	if (!res)
+	  {
+	    res = -1;
+	    break;
+	  }
+      }
+
+  if (res < 0)
+    log(L_REMOTE "%s: Malformed result from controller %s", p->name, c->cf->host);
+  TRACE(D_ROUTES, "Controller result: %d installed, %d rejected, %d table full",
+	count[SEF_INSTALLED >> 2], count[SEF_REJECTED >> 2], count[SEF_FULL >> 2]);
+}
+
+/*
+ * Snapshots
+ *
+ * With the initial snapshot option, the routes the core feeds us when
+ * we come up just fill in the shadow tables. When the feed is over, all
+ * of them go to RheaFlow as a single <SDN_SNAPSHOT> message, followed
+ * by the usual incremental announcements, each RheaFlow instance
+ * getting just its own routes. The same happens whenever the connection
+ * to an instance is established again, or has fallen too far behind.
+ * Prefixes suppressed by dampening are left out, and all next hop
+ * groups are defined anew beforehand.
+ */
+
+#define SDN_PARALLEL_MIN	65536	/* Routes worth more threads */
+
+static void
+sdn_ctl_reserve(struct sdn_controller *c, int len)
+{
+  while (c->len + len > c->size)
+    c->size *= 2;
+  c->buf = mb_realloc(c->buf, c->size);
+}
+
+/* Take the records of a shard encoded by sdn_encode_table() */
+static void
+sdn_ctl_emit(void *data, char *buf, int len, int count)
+{
+  struct sdn_controller *c = data;
+
+  sdn_ctl_reserve(c, len + 2);
+  if (c->count)
+    c->len += bsprintf(c->buf + c->len, ", ");
+  memcpy(c->buf + c->len, buf, len);
+  c->len += len;
+  c->count += count;
+}
+
+/* Encode a snapshot in place of the batch, the buffer grows as needed */
+static void
+sdn_ctl_snapshot(struct sdn_controller *c)
+{
+  struct proto *p = c->proto;
+  struct sdn_nexthops *nh = &P->nexthops;
+  struct sdn_ring *ring = (P->ring.controllers > 1) ? &P->ring : NULL;
+  struct sdn_table *t;
+  struct sdn_entry *e;
+  u32 i;
+
+  c->resync = 0;
+  c->len = 0;
+  c->open = 0;
+  sdn_status_reset(c);
+
+  for (i = 1; i < nh->used; i++)
+    if (nh->nh[i].uses && nh->nh[i].group)
+      nh->nh[i].group->told &= ~(1u << c->id);
+  sdn_batch_groups(c);
+
+  c->len += bsprintf(c->buf + c->len, "<SDN_SNAPSHOT> {\"seq\" : %lu, \"routes\" : [", (unsigned long) P->seq);
+  c->count = 0;
+
+  WALK_LIST(t, P->tables)
+    {
+      if ((P->threads > 1) && (t->fib.entries >= SDN_PARALLEL_MIN))
+	{
+	  sdn_encode_table(&t->fib, t->id, nh, P->budget.limit, !P_CF->compact, ring, c->id, P->threads, sdn_ctl_emit, c);
+	  continue;
+	}
+
+      FIB_WALK(&t->fib, fn)
+	{
+	  e = (struct sdn_entry *) fn;
+	  if (!sdn_entry_exported(e, P->budget.limit, !P_CF->compact))
+	    continue;
+	  if (ring && (sdn_ctl_of(p, e) != c))
+	    continue;
+
+	  if (c->len + SDN_RECORD_MAX > c->size)
+	    sdn_ctl_reserve(c, SDN_RECORD_MAX);
+
+	  c->len += sdn_format_route(p, c->buf + c->len, c->count++, e);
+	}
+      FIB_WALK_END;
+    }
+
+  c->len += bsprintf(c->buf + c->len, "]}\n");
+  c->records += c->count;
+  TRACE(D_EVENTS, "Snapshot of %d routes queued for controller %s", c->count, c->cf->host);
+}
+
+static void
+sdn_send_snapshot(struct proto *p)
+{
+  struct sdn_controller *c;
+  int i;
 
-  z = zq_new(p->pool);
-  z->type = ZMQ_REP;
-  z->url = xmalloc(strlen(url)+1);
-  strcpy(z->url, url);
-  z->url[strlen(url)] = '\0';
-  //s->rx_hook = unix_connect;
-  z->rx_hook = zeromq_rx;
-  z->rbsize = 1024;
-  // need to set proper rbuf, rbsize etc 
-  //if (!s->rbuf && s->rbsize)
-      z->rbuf = z->rbuf_alloc = xmalloc(z->rbsize);
-      z->rpos = z->rbuf;
-      if (!z->tbuf && z->tbsize)
-          z->tbuf = z->tbuf_alloc = xmalloc(z->tbsize);
-      z->tpos = z->ttx = z->tbuf;
-  //}
-  z->data = p;
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    if ((c = P->ctl[i]) && (c->state == SDN_CTL_UP))
+      {
+	c->resync = 1;
+	sdn_batch_flush(c);
+      }
+}
 
-  //unlink(socketname);
+static u32
+sdn_route_count(struct proto *p)
+{
+  struct sdn_table *t;
+  u32 n = 0;
 
-  if(zq_open(z) < 0){
-    die("Cannot open socket");
-  }
-  CHK_MAGIC;
-  //add_head( &P->sockets, NODE s );
-  return z;
+  WALK_LIST(t, P->tables)
+    n += t->routes;
+  return n;
 }
 
-static sock*
-init_unix_socket(struct proto *p)
+static void sdn_ctl_connect(struct sdn_controller *c);
+
+static void
+sdn_ctl_down(struct sdn_controller *c)
+{
+  struct proto *p = c->proto;
+
+  rfree(c->sk);
+  c->sk = NULL;
+  c->state = SDN_CTL_RETRY;
+  c->busy = 0;
+  c->len = 0;
+  c->open = 0;
+
+  TRACE(D_EVENTS, "Retrying controller %s in %d seconds", c->cf->host, c->backoff);
+  tm_start(c->retry, c->backoff);
+  c->backoff = MIN(2 * c->backoff, SDN_CTL_RETRY_MAX);
+}
+
+/* Connection established, or a batch written out */
+static void
+sdn_ctl_tx(sock *s)
+{
+  struct sdn_controller *c = s->data;
+  struct proto *p = c->proto;
+
+  if (c->state == SDN_CTL_CONNECTING)
+    {
+      log(L_INFO "%s: Connected to controller %s (%I port %d)", p->name, c->cf->host, s->daddr, s->dport);
+      c->state = SDN_CTL_UP;
+      c->backoff = SDN_CTL_RETRY_MIN;
+
+      /* Unless the initial feed is still going on, catch up on what we have */
+      c->resync = !P->syncing && (c->connects || sdn_route_count(p));
+      c->connects++;
+    }
+
+  c->busy = 0;
+  if (c->out_size > SDN_BATCH_SIZE)
+    {
+      mb_free(c->out);
+      c->out = mb_alloc(p->pool, SDN_BATCH_SIZE);
+      c->out_size = SDN_BATCH_SIZE;
+    }
+  sdn_batch_flush(c);
+}
+
+/* Replies come one per line */
+static int
+sdn_ctl_rx(sock *s, int size)
+{
+  struct sdn_controller *c = s->data;
+  struct proto *p = c->proto;
+  byte *line = s->rbuf, *end = s->rbuf + size, *nl;
+
+  while ((nl = memchr(line, '\n', end - line)))
+    {
+      sdn_ctl_reply(c, (char *) line, nl - line);
+      line = nl + 1;
+    }
+
+  if ((line == s->rbuf) && (size == (int) s->rbsize))
+    {
+      log(L_WARN "%s: Reply from controller %s too long, ignored", p->name, c->cf->host);
+      line = end;
+    }
+
+  memmove(s->rbuf, line, end - line);
+  s->rpos = s->rbuf + (end - line);
+  return 0;
+}
+
+static void
+sdn_ctl_err(sock *s, int err)
+{
+  struct sdn_controller *c = s->data;
+  struct proto *p = c->proto;
+
+  if (c->state == SDN_CTL_UP)
+    {
+      if (err)
+	log(L_ERR "%s: Lost connection to controller %s: %M", p->name, c->cf->host, err);
+      else
+	log(L_ERR "%s: Controller %s has closed the connection", p->name, c->cf->host);
+    }
+  else if (c->backoff == SDN_CTL_RETRY_MIN)
+    log(L_WARN "%s: Cannot connect to controller %s (%I port %d): %M", p->name, c->cf->host, s->daddr, s->dport, err);
+
+  sdn_ctl_down(c);
+}
+
+static void
+sdn_ctl_connect(struct sdn_controller *c)
 {
+  struct proto *p = c->proto;
   sock *s;
-  char* socketname = (P_CF->unixsocket?P_CF->unixsocket:"/tmp/sdn.sock");
-  log_msg(L_DEBUG "Socket in config is %s\n", P_CF->unixsocket);
 
   s = sk_new(p->pool);
-  s->type = SK_UNIX;
-  //s->rx_hook = unix_connect;
-  s->rx_hook = unix_rx;
-  s->rbsize = 1024;
-  // need to set proper rbuf, rbsize etc 
-  //if (!s->rbuf && s->rbsize)
-      s->rbuf = s->rbuf_alloc = xmalloc(s->rbsize);
-      s->rpos = s->rbuf;
-      if (!s->tbuf && s->tbsize)
-          s->tbuf = s->tbuf_alloc = xmalloc(s->tbsize);
-      s->tpos = s->ttx = s->tbuf;
-  //}
-  s->data = p;
+  s->type = SK_TCP_ACTIVE;
+  s->daddr = c->cf->addr;
+  s->dport = c->cf->port;
+  s->rbsize = SDN_BATCH_SIZE;
+  s->rx_hook = sdn_timed_ctl_rx;
+  s->tx_hook = sdn_ctl_tx;
+  s->err_hook = sdn_ctl_err;
+  s->data = c;
 
-  //unlink(socketname);
+  c->sk = s;
+  c->state = SDN_CTL_CONNECTING;
+  TRACE(D_EVENTS, "Connecting to controller %s (%I port %d)", c->cf->host, s->daddr, s->dport);
 
-  if(sk_open_unix_connect(s, socketname) < 0){
-    die("Cannot open socket");
-  }
-  CHK_MAGIC;
-  //add_head( &P->sockets, NODE s );
-  return s;
+  if (sk_open(s) < 0)
+    {
+      log(L_ERR "%s: Cannot open socket to controller %s", p->name, c->cf->host);
+      sdn_ctl_down(c);
+    }
 }
 
-/**
- * new_iface
- * @p: myself
- * @new: interface to be created or %NULL if we are creating a magic
- * socket. The magic socket is used for listening and also for
- * sending requested responses.
- * @flags: interface flags
- * @patt: pattern this interface matched, used for access to config options
+static void
+sdn_ctl_retry(timer *t)
+{
+  sdn_ctl_connect(t->data);
+}
+
+/* Set up a controller in the first free slot, not connected yet */
+static struct sdn_controller *
+sdn_ctl_add(struct proto *p, struct sdn_ctl_config *cf)
+{
+  struct sdn_controller *c;
+  int id;
+
+  for (id = 0; P->ctl[id]; id++)
+    ;
+
+  c = mb_allocz(p->pool, sizeof(struct sdn_controller));
+  c->proto = p;
+  c->cf = cf;
+  c->id = id;
+  c->size = c->out_size = SDN_BATCH_SIZE;
+  c->buf = mb_alloc(p->pool, c->size);
+  c->out = mb_alloc(p->pool, c->out_size);
+  c->flush = ev_new(p->pool);
+  c->flush->hook = sdn_timed_batch_event;
+  c->flush->data = c;
+  c->retry = tm_new(p->pool);
+  c->retry->hook = sdn_ctl_retry;
+  c->retry->data = c;
+  c->backoff = SDN_CTL_RETRY_MIN;
+
+  P->ctl[id] = c;
+  return c;
+}
+
+static void
+sdn_ctl_open(struct sdn_controller *c)
+{
+  struct proto *p = c->proto;
+
+  if (P_CF->controller_mock)
+    {
+      /* Nothing to connect to, batches are just counted */
+      c->state = SDN_CTL_UP;
+      c->resync = !P->syncing && (c->connects || sdn_route_count(p));
+      c->connects++;
+      if (c->resync)
+	ev_schedule(c->flush);
+      return;
+    }
+
+  sdn_ctl_connect(c);
+}
+
+static void
+sdn_ctl_free(struct sdn_controller *c)
+{
+  struct proto *p = c->proto;
+  struct sdn_nexthops *nh = &P->nexthops;
+  u32 i;
+
+  /* Whoever gets the slot next has not heard of any group */
+  for (i = 1; i < nh->used; i++)
+    if (nh->nh[i].uses && nh->nh[i].group)
+      nh->nh[i].group->told &= ~(1u << c->id);
+
+  rfree(c->sk);
+  rfree(c->flush);
+  rfree(c->retry);
+  mb_free(c->buf);
+  mb_free(c->out);
+  P->ctl[c->id] = NULL;
+  mb_free(c);
+}
+
+static void
+sdn_ctl_start(struct proto *p)
+{
+  struct sdn_ctl_config *cf;
+  int i;
+
+  WALK_LIST(cf, P_CF->controllers)
+    sdn_ctl_add(p, cf);
+  sdn_ring_build(&P->ring, p->pool, P->ctl);
+
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    if (P->ctl[i])
+      sdn_ctl_open(P->ctl[i]);
+}
+
+/*
+ * sdn_ctl_reconfigure - switch over to a new list of controllers
  *
- * Create an interface structure and start listening on the interface.
+ * Controllers listed in both keep their connections. Routes owned by
+ * another controller on the new ring than on the old one are withdrawn
+ * from the old owner and announced to the new one; everything else
+ * stays where it is. Controllers added get a snapshot of their routes
+ * once connected, as usual; those removed are just disconnected.
  */
+static void
+sdn_ctl_reconfigure(struct proto *p, struct sdn_proto_config *new)
+{
+  struct sdn_ctl_config *cf, *add[SDN_CTL_MAX];
+  struct sdn_controller *c;
+  struct sdn_ring old;
+  struct sdn_table *t;
+  struct sdn_entry *e;
+  u32 kept = 0, fresh = 0, moved = 0;
+  int i, from, to, adds = 0, removed = 0;
 
+  WALK_LIST(cf, new->controllers)
+    {
+      for (i = 0; i < SDN_CTL_MAX; i++)
+	if ((c = P->ctl[i]) && !(kept & (1u << i)) &&
+	    !strcmp(c->cf->host, cf->host) && (c->cf->port == cf->port))
+	  break;
 
-// new_iface(struct proto *p, struct iface *new, unsigned long flags, struct iface_patt *patt )
-//static sock *
-//new_listening_iface(ip_addr addr, unsigned port, u32 flags)
-//static sock *
-static struct sdn_interface*
-new_iface(struct proto *p, struct iface *new, unsigned long flags, struct iface_patt *patt )
+      if (i < SDN_CTL_MAX)
+	{
+	  /* The address may have changed, the next connection will use it */
+	  c->cf = cf;
+	  kept |= 1u << i;
+	}
+      else
+	add[adds++] = cf;
+    }
+
+  old = P->ring;
+  P->ring.point = NULL;
+
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    if (P->ctl[i] && !(kept & (1u << i)))
+      {
+	log(L_INFO "%s: Controller %s removed", p->name, P->ctl[i]->cf->host);
+	sdn_ctl_free(P->ctl[i]);
+	removed++;
+      }
+  for (i = 0; i < adds; i++)
+    fresh |= 1u << sdn_ctl_add(p, add[i])->id;
+  sdn_ring_build(&P->ring, p->pool, P->ctl);
+
+  if ((adds || removed) && !P->syncing)
+    {
+      WALK_LIST(t, P->tables)
+	{
+	  FIB_WALK(&t->fib, fn)
+	    {
+	      e = (struct sdn_entry *) fn;
+	      if (!sdn_entry_exported(e, P->budget.limit, !P_CF->compact))
+		continue;
+
+	      from = sdn_ring_owner(&old, sdn_ring_hash(fn->prefix, fn->pxlen));
+	      to = sdn_ring_owner(&P->ring, sdn_ring_hash(fn->prefix, fn->pxlen));
+	      if ((from == to) && !(fresh & (1u << to)))
+		continue;
+
+	      sdn_entry_status(p, e, SEF_PENDING);
+	      if (kept & (1u << from))
+		sdn_batch_add_to(P->ctl[from], e, 1);
+	      sdn_batch_add_to(P->ctl[to], e, 0);
+	      moved++;
+	    }
+	  FIB_WALK_END;
+	}
+      log(L_INFO "%s: %u routes moved to other controllers", p->name, moved);
+    }
+  mb_free(old.point);
+
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    if (fresh & (1u << i))
+      {
+	log(L_INFO "%s: Controller %s added", p->name, P->ctl[i]->cf->host);
+	sdn_ctl_open(P->ctl[i]);
+      }
+}
+
+static char *
+sdn_ctl_state(struct sdn_controller *c, char *buf)
 {
-  struct sdn_interface *rif;
-  struct sdn_patt *PATT = (struct sdn_patt *) patt;
-  rif = mb_allocz(p->pool, sizeof( struct sdn_interface ));
-  rif->iface = new;
-  rif->proto = p;
-  rif->busy = NULL;
-  if (PATT) {
-    rif->mode = PATT->mode;
-    rif->metric = PATT->metric;
-    rif->multicast = (!(PATT->mode & IM_BROADCAST)) && (flags & IF_MULTICAST);
-    //rif->check_ttl = (PATT->ttl_security == 1);
-  }
-  /* lookup multicasts over unnumbered links - no: rip is not defined over unnumbered links */
+  struct proto *p = c->proto;
 
-  if (rif->multicast)
-    DBG( "Doing multicasts!\n" );
+  if (P_CF->controller_mock)
+    return "Mock controller";
 
-  rif->sock = sk_new( p->pool );
-  rif->sock->type = SK_UDP;
-  rif->sock->sport = P_CF->port;
-  rif->sock->rx_hook = sdn_rx;
-  rif->sock->data = rif;
-  rif->sock->rbsize = 10240;
-  rif->sock->iface = new;		/* Automagically works for dummy interface */
-  rif->sock->tbuf = mb_alloc( p->pool, sizeof( struct sdn_packet ));
-  rif->sock->tx_hook = sdn_tx;
-  rif->sock->err_hook = sdn_tx_err;
-  rif->sock->daddr = IPA_NONE;
-  rif->sock->dport = P_CF->port;
-  if (new)
+  switch (c->state)
     {
-      rif->sock->tos = PATT->tx_tos;
-      rif->sock->priority = PATT->tx_priority;
-      rif->sock->ttl = PATT->ttl_security ? 255 : 1;
-      // rif->sock->flags = SKF_LADDR_RX | (rif->check_ttl ? SKF_TTL_RX : 0);
+    case SDN_CTL_UP:
+      return "Connected";
+    case SDN_CTL_CONNECTING:
+      return "Connecting";
+    default:
+      bsprintf(buf, "Retry in %ds", (int) tm_remains(c->retry));
+      return buf;
     }
+}
 
-  if (new) {
-    if (new->addr->flags & IA_PEER)
-      log( L_WARN "%s: sdn is not defined over unnumbered links", p->name );
-    if (rif->multicast) {
-#ifndef IPV6
-      rif->sock->daddr = ipa_from_u32(0xe0000009);
-#else
-      rif->sock->daddr = ipa_build(0xff020000, 0, 0, 9);
-#endif
-    } else {
-      rif->sock->daddr = new->addr->brd;
+/* Bytes sent to all controllers */
+static u64
+sdn_ctl_sent(struct proto *p)
+{
+  u64 sent = 0;
+  int i;
+
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    if (P->ctl[i])
+      sent += P->ctl[i]->sent;
+  return sent;
+}
+
+/*
+ * Dampening
+ *
+ * Route flap dampening after RFC 2439 keeps unstable prefixes from
+ * turning into a stream of flow-mods. Every withdrawal of a prefix adds
+ * a penalty to its flap history (half of it for a change of the next
+ * hop), and the penalty halves every half life. Once it exceeds the
+ * suppress limit, the controller is told to remove the prefix and hears
+ * nothing more about it until the penalty falls below the reuse limit.
+ * The penalty is capped so that this takes at most the max suppress
+ * time. Dampening applies only to the announcements sent to RheaFlow;
+ * the shadow table, dumps and digests keep showing the real state.
+ *
+ * Penalties decay lazily: a history stores the penalty as of the time
+ * it was last touched and the decay is applied when it is needed again.
+ * Each history sits on the reuse wheel at the time it is next of
+ * interest -- when it falls below the reuse limit if suppressed, or
+ * below half of it otherwise, when the history is forgotten. Prefixes
+ * released from suppression in one timer tick are announced in a single
+ * message.
+ */
+
+#define SDN_DAMP_SEND		0	/* Send the change as usual */
+#define SDN_DAMP_WITHDRAW	1	/* Send a withdrawal instead */
+#define SDN_DAMP_HOLD		2	/* Send nothing */
+
+/* 2^(-i/16) in 16.16 fixed point */
+static const u32 sdn_damp_decay[16] = {
+  65536, 62757, 60097, 57549, 55109, 52773, 50535, 48393,
+  46341, 44376, 42495, 40693, 38968, 37316, 35734, 34219
+};
+
+/* @penalty decayed by @k sixteenths of the half life */
+static inline u32
+sdn_damp_value(u32 penalty, unsigned k)
+{
+  if (k >= 16 * 32)
+    return 0;
+  return ((u64) (penalty >> (k / 16)) * sdn_damp_decay[k % 16]) >> 16;
+}
+
+static u32
+sdn_damp_ceiling(struct proto *p)
+{
+  int hl = P_CF->damp_half_life;
+  unsigned q = P_CF->damp_max_suppress / hl;
+  unsigned r = (P_CF->damp_max_suppress % hl) * 16 / hl;
+  u64 c;
+
+  if (q >= 30)
+    return 0x3fffffff;
+  c = ((u64) P_CF->damp_reuse << q) * 65536 / sdn_damp_decay[r];
+  return MIN(c, 0x3fffffff);
+}
+
+static void
+sdn_damp_age(struct proto *p, struct sdn_damp *d)
+{
+  int hl = P_CF->damp_half_life;
+  unsigned k = (now - d->last) * 16 / hl;
+
+  if (!k)
+    return;
+  d->penalty = sdn_damp_value(d->penalty, k);
+  d->last += k * hl / 16;
+}
+
+/* Penalty below which the prefix is reused, or its history forgotten */
+static inline u32
+sdn_damp_limit(struct proto *p, struct sdn_damp *d)
+{
+  return MAX(d->suppressed ? P_CF->damp_reuse : P_CF->damp_reuse / 2, 1);
+}
+
+/* When the history is to be checked again */
+static bird_clock_t
+sdn_damp_next(struct proto *p, struct sdn_damp *d)
+{
+  u32 limit = sdn_damp_limit(p, d);
+  int hl = P_CF->damp_half_life;
+  unsigned k = 0;
+
+  while ((d->penalty >> (k / 16 + 1)) >= limit)
+    k += 16;
+  while (sdn_damp_value(d->penalty, k) >= limit)
+    k++;
+
+  return MAX(d->last + (bird_clock_t) ((k * hl + 15) / 16), now + 1);
+}
+
+/*
+ * sdn_damp_update - account a change of @e to its flap history
+ * @live: the prefix is reachable after the change
+ * @penalty: how bad the change is
+ *
+ * Returns what to tell the controller.
+ */
+static int
+sdn_damp_update(struct proto *p, struct sdn_entry *e, int live, unsigned penalty)
+{
+  struct sdn_damp *d;
+
+  if (!P_CF->damping)
+    return SDN_DAMP_SEND;
+
+  d = SDN_EXT(e)->damp;
+  if (!d)
+    {
+      if (!penalty)
+	return SDN_DAMP_SEND;
+
+      d = SDN_EXT(e)->damp = sl_alloc(P->damp_slab);
+      d->e = e;
+      d->penalty = 0;
+      d->last = now;
+      d->suppressed = 0;
+      d->told = 1;
+      d->when = now + 1;
+      sdn_wheel_add(&P->reuse, &d->n, d->when);
     }
-  }
 
-  if (!ipa_nonzero(rif->sock->daddr)) {
-    if (rif->iface)
-      log( L_WARN "%s: interface %s is too strange for me", p->name, rif->iface->name );
-  } else {
+  sdn_damp_age(p, d);
+  d->penalty = MIN(d->penalty + penalty, P->damp_ceiling);
 
-    if (sk_open(rif->sock) < 0)
-      goto err;
+  if (!d->suppressed && (d->penalty >= (u32) P_CF->damp_suppress))
+    {
+      d->suppressed = 1;
+      P->damp_count++;
+      TRACE(D_EVENTS, "Prefix %I/%d flaps, suppressed", e->n.prefix, e->n.pxlen);
+    }
 
-    if (rif->multicast)
-      {
-	if (sk_setup_multicast(rif->sock) < 0)
-	  goto err;
-	if (sk_join_group(rif->sock, rif->sock->daddr) < 0)
-	  goto err;
-      }
-    else
-      {
-	if (sk_setup_broadcast(rif->sock) < 0)
-	  goto err;
-      }
-  }
+  d->when = sdn_damp_next(p, d);
+  sdn_wheel_update(&P->reuse, &d->n, d->when);
 
-  TRACE(D_EVENTS, "Listening on %s, port %d, mode %s (%I)", rif->iface ? rif->iface->name : "(dummy)", P_CF->port, rif->multicast ? "multicast" : "broadcast", rif->sock->daddr );
-  
-  return rif;
+  if (!d->suppressed)
+    {
+      d->told = live;
+      return SDN_DAMP_SEND;
+    }
 
- err:
-  sk_log_error(rif->sock, p->name);
-  log(L_ERR "%s: Cannot open socket for %s", p->name, rif->iface ? rif->iface->name : "(dummy)" );
-  if (rif->iface) {
-    rfree(rif->sock);
-    mb_free(rif);
-    return NULL;
-  }
-  /* On dummy, we just return non-working socket, so that user gets error every time anyone requests table */
-  return rif;
+  if (!d->told)
+    return SDN_DAMP_HOLD;
 
+  d->told = 0;
+  return live ? SDN_DAMP_WITHDRAW : SDN_DAMP_SEND;
 }
 
-/*static struct sdn_interface *
-new_iface(struct proto *p, struct iface *new, unsigned long flags, struct iface_patt *patt )
+static bird_clock_t
+sdn_damp_expires(struct sdn_wheel *w, node *n)
 {
-  struct sdn_interface *rif;
-  struct sdn_patt *PATT = (struct sdn_patt *) patt;
+  return ((struct sdn_damp *) n)->when;
+}
 
-  rif = mb_allocz(p->pool, sizeof( struct sdn_interface ));
-  rif->iface = new;
-  rif->proto = p;
-  rif->busy = NULL;
-  if (PATT) {
-    rif->mode = PATT->mode;
-    rif->metric = PATT->metric;
-    rif->multicast = (!(PATT->mode & IM_BROADCAST)) && (flags & IF_MULTICAST);
-  }
+static void
+sdn_damp_expire(struct sdn_wheel *w, node *n)
+{
+  struct proto *p = w->data;
+  struct sdn_damp *d = (struct sdn_damp *) n;
+  struct sdn_entry *e = d->e;
 
-  if (rif->multicast)
-    DBG( "Doing multicasts!\n" );
+  sdn_damp_age(p, d);
 
-  rif->sock = sk_new( p->pool );
-  rif->sock->type = SK_UDP;
-  rif->sock->sport = P_CF->port;
-  rif->sock->rx_hook = sdn_rx;
-  rif->sock->data = rif;
-  rif->sock->rbsize = 10240;
-  rif->sock->iface = new;		// Automagically works for dummy interface
-  rif->sock->tbuf = mb_alloc( p->pool, sizeof( struct sdn_packet ));
-  rif->sock->tx_hook = sdn_tx;
-  rif->sock->err_hook = sdn_tx_err;
-  rif->sock->daddr = IPA_NONE;
-  rif->sock->dport = P_CF->port;
-  if (new)
+  if (d->penalty < sdn_damp_limit(p, d))
     {
-      rif->sock->ttl = 1;
-      rif->sock->tos = IP_PREC_INTERNET_CONTROL;
-      rif->sock->flags = SKF_LADDR_RX;
-    }
+      if (!d->suppressed)
+	{
+	  sdn_wheel_remove(w, n);
+	  sl_free(P->damp_slab, d);
+	  SDN_EXT(e)->damp = NULL;
+	  sdn_entry_gc(p, e);
+	  return;
+	}
 
-  if (new) {
-    if (new->addr->flags & IA_PEER)
-      log( L_WARN "%s: sdn is not defined over unnumbered links", p->name );
-    rif->sock->saddr = IPA_NONE;
-    if (rif->multicast) {
-#ifndef IPV6
-      rif->sock->daddr = ipa_from_u32(0xe0000009);
-#else
-      rif->sock->daddr = ipa_build(0xff020000, 0, 0, 9);
-#endif
-    } else {
-      rif->sock->daddr = new->addr->brd;
+      d->suppressed = 0;
+      P->damp_count--;
+      add_tail(&P->reused, &d->batch);
     }
-    rif->sock->daddr = ipa_from_u32(0x00000000);
-  }
-  if (!ipa_nonzero(rif->sock->daddr)) {
-    if (rif->iface)
-      log( L_WARN "%s: interface %s is too strange for me", p->name, rif->iface->name );
-  } else { 
 
-    if (sk_open(rif->sock) < 0)
-      goto err;
+  d->when = sdn_damp_next(p, d);
+  sdn_wheel_update(w, n, d->when);
+}
 
-    if (rif->multicast)
-      {
-	if (sk_setup_multicast(rif->sock) < 0)
-	  goto err;
-	if (sk_join_group(rif->sock, rif->sock->daddr) < 0)
-	  goto err;
-      }
-    else
-      {
-	if (sk_setup_broadcast(rif->sock) < 0)
-	  goto err;
-      }
-  }
+/* Announce prefixes released from suppression */
+static void
+sdn_damp_reuse(struct proto *p)
+{
+  struct sdn_damp *d;
+  node *x;
+  int n = 0;
 
-  TRACE(D_EVENTS, "Listening on %s, port %d, mode %s (%I)", rif->iface ? rif->iface->name : "(dummy)", P_CF->port, rif->multicast ? "multicast" : "broadcast", rif->sock->daddr );
-  
-  return rif;
+  WALK_LIST_FIRST(x, P->reused)
+    {
+      d = SKIP_BACK(struct sdn_damp, batch, x);
+      rem_node(x);
+      if (d->e->n.flags & SEF_DELETED)
+	continue;
 
- err:
-  sk_log_error(rif->sock, p->name);
-  log_msg(L_ERR "Error opening socket on %s", rif->iface);
-  log(L_ERR "%s: Cannot open socket for %s", p->name, rif->iface ? rif->iface->name : "(dummy)" );
-  if (rif->iface) {
-    rfree(rif->sock);
-    mb_free(rif);
-    return NULL;
-  }
-  // On dummy, we just return non-working socket, so that user gets error every time anyone requests table
-  return rif;
-}*/
+      if (!P->syncing && sdn_entry_exported(d->e, P->budget.limit, !P_CF->compact))
+	sdn_batch_add(p, d->e, 0);
+      d->told = 1;
+      n++;
+    }
+
+  if (n)
+    TRACE(D_EVENTS, "%d prefixes released from suppression", n);
+}
+
+/*
+ * Stale routes
+ *
+ * When an upstream session resets, the core withdraws all of its routes
+ * as the protocol is flushed, and most of them come back moments after
+ * the session does. That would cost RheaFlow two flow mods per route
+ * for nothing. With a stale time configured, such a withdrawal only
+ * marks the entry stale, and it stays as it was, in the shadow table as
+ * well as in RheaFlow. So do all entries when a refeed of ours begins,
+ * e.g. after reload out. A route announced again loses its mark, and
+ * if its next hop has not changed, nobody hears of it at all.
+ *
+ * The refresh ends with the end of the refeed, or the stale time after
+ * the last withdrawal of a flushed protocol, as the end of the routes of
+ * the session coming back cannot be seen from here. The sweep then
+ * withdraws the entries still stale, all in one batch. Any other
+ * withdrawal goes to RheaFlow at once, even during a refresh. A route
+ * that comes back in time does not count as a flap for the dampening.
+ */
 
 static void
-sdn_real_if_add(struct object_lock *lock)
+sdn_stale_mark(struct proto *p, struct sdn_entry *e)
 {
-  struct iface *iface = lock->iface;
-  struct proto *p = lock->data;
-  struct sdn_interface *rif;
-  struct iface_patt *k = iface_patt_find(&P_CF->iface_list, iface, iface->addr);
+  if (e->n.flags & SEF_STALE)
+    return;
 
-  if (!k)
-    bug("This can not happen! It existed few seconds ago!" );
-  log_msg(L_DEBUG "adding interface %s", iface->name);
-  DBG("adding interface %s\n", iface->name );
-  rif = new_iface(p, iface, iface->flags, k);
-  if (rif) {
-    add_head( &P->interfaces, NODE rif );
-    DBG("Adding object lock of %p for %p\n", lock, rif);
-    log_msg(L_DEBUG "Adding object lock of %p for %p\n", lock, rif);
-    rif->lock = lock;
-  } else { rfree(lock); }
+  e->n.flags |= SEF_STALE;
+  P->stale_count++;
 }
 
 static void
-sdn_if_notify(struct proto *p, unsigned c, struct iface *iface)
+sdn_stale_clear(struct proto *p, struct sdn_entry *e)
 {
-  DBG( "sdn: if notify\n" );
-  log_msg(L_DEBUG "Calling sdn_if_notify for if: %s", iface->name);
-  if (iface->flags & IF_IGNORE){
-    log_msg(L_DEBUG "Ignoring if %s", iface->name);
-    return;
-  }
-  if (c & IF_CHANGE_DOWN) {
-    struct sdn_interface *i;
-    log_msg(L_DEBUG "Interface %s going down", iface->name);
-    i = find_interface(p, iface);
-    if (i) {
-      rem_node(NODE i);
-      rfree(i->lock);
-      kill_iface(i);
-    }
-  }
-  if (c & IF_CHANGE_UP) {
-    struct iface_patt *k = iface_patt_find(&P_CF->iface_list, iface, iface->addr);
-    struct object_lock *lock;
-    struct sdn_patt *PATT = (struct sdn_patt *) k;
+  e->n.flags &= ~SEF_STALE;
+  P->stale_count--;
+  P->stale_kept++;
+}
 
-    log_msg(L_DEBUG "Interface %s going up", iface->name);
+/* Hold back the withdrawal of @old if it is part of a refresh */
+static int
+sdn_stale_hold(struct proto *p, struct sdn_table *t, net *n, rte *old)
+{
+  struct sdn_entry *e;
 
-    if (!k) {
-      log_msg(L_DEBUG "Not interested in interface %s", iface->name);
-      return; /* We are not interested in this interface */
-    }
+  if (!P_CF->stale_time || !old)
+    return 0;
+  if (!P->stale_feed && (old->attrs->src->proto->core_state != FS_FLUSHING))
+    return 0;
 
-    lock = olock_new( p->pool );
-    if (!(PATT->mode & IM_BROADCAST) && (iface->flags & IF_MULTICAST)){
-      log_msg(L_DEBUG "multicast and broadcast flags");
-#ifndef IPV6
-      lock->addr = ipa_from_u32(0xe0000009);
-#else
-      ip_pton("FF02::9", &lock->addr);
-#endif
+  e = fib_find( &t->fib, &n->n.prefix, n->n.pxlen );
+  if (!e || (e->n.flags & SEF_DELETED))
+    return 0;
+
+  if (!P->stale_feed)
+    {
+      if (!P->stale_until)
+	tm_start(P->stale_timer, P_CF->stale_time);
+      P->stale_until = now + P_CF->stale_time;
     }
-    else {
-      log_msg(L_DEBUG "not multicast/broadcast flags");
-      lock->addr = iface->addr->brd;
+  sdn_stale_mark(p, e);
+  return 1;
+}
+
+static void
+sdn_feed_begin(struct proto *p, int initial)
+{
+  struct sdn_table *t;
+  struct sdn_entry *e;
+
+  if (initial || !P_CF->stale_time)
+    return;
+
+  P->stale_feed = 1;
+  WALK_LIST(t, P->tables)
+    {
+      FIB_WALK(&t->fib, fn)
+	{
+	  e = (struct sdn_entry *) fn;
+	  if (!(e->n.flags & SEF_DELETED))
+	    sdn_stale_mark(p, e);
+	}
+      FIB_WALK_END;
     }
-    lock->port = P_CF->port;
-    lock->iface = iface;
-    lock->hook = sdn_real_if_add;
-    lock->data = p;
-    lock->type = OBJLOCK_UDP;
-    olock_acquire(lock);
-  }
+  TRACE(D_EVENTS, "Refeed begins, %u routes marked stale", P->stale_count);
 }
 
-static struct ea_list *
-sdn_gen_attrs(struct linpool *pool, int metric, u16 tag)
+static void
+sdn_feed_end(struct proto *p)
 {
-  struct ea_list *l = lp_alloc(pool, sizeof(struct ea_list) + 2*sizeof(eattr));
+  if (!P->stale_feed)
+    return;
 
-  l->next = NULL;
-  l->flags = EALF_SORTED;
-  l->count = 2;
-  l->attrs[0].id = EA_SDN_TAG;
-  l->attrs[0].flags = 0;
-  l->attrs[0].type = EAF_TYPE_INT | EAF_TEMP;
-  l->attrs[0].u.data = tag;
-  l->attrs[1].id = EA_SDN_METRIC;
-  l->attrs[1].flags = 0;
-  l->attrs[1].type = EAF_TYPE_INT | EAF_TEMP;
-  l->attrs[1].u.data = metric;
-  return l;
+  /* Sweep from the timer, not from within the core */
+  P->stale_feed = 0;
+  tm_start(P->stale_timer, 0);
 }
 
-static int
-sdn_import_control(struct proto *p, struct rte **rt, struct ea_list **attrs, struct linpool *pool)
+static void
+sdn_stale_sweep(timer *tm)
 {
-  if ((*rt)->attrs->src->proto == p)	/* My own must not be touched */
-    return 1;
+  struct proto *p = tm->data;
+  struct sdn_entry **stale, *e;
+  struct sdn_table *t;
+  u32 n = 0, i;
 
-  if ((*rt)->attrs->source != RTS_SDN) {
-    struct ea_list *new = sdn_gen_attrs(pool, 1, 0);
-    new->next = *attrs;
-    *attrs = new;
-	// say yes for giggles
-	return 1;
-  }
-  return 0;
+  /* The refresh is not over yet */
+  if (P->stale_feed)
+    return;
+  if (P->stale_until > now)
+    {
+      tm_start(tm, P->stale_until - now);
+      return;
+    }
+
+  P->stale_until = 0;
+  if (!P->stale_count)
+    return;
+
+  /* Withdrawn entries may be deleted from the fib, so not during the walk */
+  stale = mb_alloc(p->pool, P->stale_count * sizeof(struct sdn_entry *));
+  WALK_LIST(t, P->tables)
+    {
+      FIB_WALK(&t->fib, fn)
+	{
+	  e = (struct sdn_entry *) fn;
+	  if (e->n.flags & SEF_STALE)
+	    {
+	      e->n.flags &= ~SEF_STALE;
+	      stale[n++] = e;
+	    }
+	}
+      FIB_WALK_END;
+    }
+
+  for (i = 0; i < n; i++)
+    sdn_export(p, stale[i]->tab, stale[i]->n.prefix, stale[i]->n.pxlen, NULL, 0);
+
+  mb_free(stale);
+  P->stale_count = 0;
+  P->stale_swept += n;
+  TRACE(D_EVENTS, "%u stale routes withdrawn", n);
 }
 
-static struct ea_list *
-sdn_make_tmp_attrs(struct rte *rt, struct linpool *pool)
+/*
+ * Flow table budget
+ *
+ * With a budget configured, RheaFlow gets just that many routes, the
+ * best ranked ones, picked by the two heaps of budget.c; the shadow
+ * table, dumps and digests still have them all. Routes matching the
+ * priority prefix set rank first, then routes with a higher EA_SDN_TAG
+ * (if the tag counts), then shorter prefixes, or longer ones if so
+ * configured. Default routes are always sent, without counting against
+ * the budget, so that traffic to the routes left out still goes
+ * somewhere. As the ranking shifts, routes pushed out of the budget are
+ * withdrawn from RheaFlow and the ones taking their place announced.
+ */
+
+static u32
+sdn_budget_rank(struct proto *p, struct sdn_entry *e, u32 tag)
 {
-  return sdn_gen_attrs(pool, rt->u.sdn.metric, rt->u.sdn.tag);
+  u32 rank = P_CF->budget_longer ? e->n.pxlen : BITS_PER_IP_ADDRESS - e->n.pxlen;
+
+  if (P_CF->budget_tag)
+    rank |= (tag & 0xffff) << 8;
+  if (P_CF->budget_priority && trie_match_prefix(P_CF->budget_priority, e->n.prefix, e->n.pxlen))
+    rank |= 1 << 24;
+  return rank;
 }
 
 static void
-sdn_store_tmp_attrs(struct rte *rt, struct ea_list *attrs)
+sdn_budget_moved(struct sdn_budget *b, struct sdn_entry *e, int in)
 {
-  rt->u.sdn.tag = ea_get_int(attrs, EA_SDN_TAG, 0);
-  rt->u.sdn.metric = ea_get_int(attrs, EA_SDN_METRIC, 1);
-}
+  struct proto *p = b->data;
 
-static void sdn_route_print_to_sockets(struct proto* p, char* route)
-{
-  struct sdn_unix_socket_wrapper *swrapper=NULL;
-  WALK_LIST(swrapper, P->sockets){
-    log_msg(L_DEBUG "printing out to socket %X", swrapper->skt->type);
-    swrapper->skt->tbuf=route;
-    sk_send(swrapper->skt, strlen(route));
-  }
-}
+  if (!in)
+    sdn_entry_status(p, e, SEF_PENDING);
 
-static void route_print_to_rhea_socket(int sockfd, char* route)
-{
-    if (sockfd >= 0) {
-       nsent = write(sockfd,route,strlen(route));
-       if(nsent < 0) {
-         log(L_ERR "Error writing to rhea socket");
-       }
-       bzero(Rheabuffer, 256);
-       nsent = read(sockfd,Rheabuffer,255);
-       if (nsent < 0) {
-          log(L_ERR "Error reading from rhea socket");
-       }
-       log_msg(L_DEBUG "Rhea says: %s",Rheabuffer);
-     }
-    else {
-       log(L_ERR "No socket for rhea client");
-    }
+  /* Suppressed prefixes are not there to withdraw, nor to be announced */
+  if (!P->syncing && !(P_CF->damping && SDN_EXT(e)->damp && SDN_EXT(e)->damp->suppressed))
+    sdn_batch_add(p, e, !in);
 }
-  
+
+/*
+ * sdn_export - put a route to the shadow table and tell the controller
+ * @a: its attributes, %NULL for a withdrawal
+ * @tag: its EA_SDN_TAG, for the budget
+ *
+ * The core feeds changes through here, and so does a trace replay.
+ */
 static void
-sdn_route_mod_str(struct proto *p, struct sdn_entry *e, struct network *net, struct rte *new, struct rte *old)
+sdn_export(struct proto *p, struct sdn_table *t, ip_addr prefix, int pxlen, rta *a, u32 tag)
 {
-  int varlen=0;
-  char* addedstring = "<SDN_ANNOUNCE> {\"added\" : [{\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}] }\n";
-  char* removedstring = "<SDN_ANNOUNCE> {\"removed\" : [{\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}] }\n";
-  char* outbuffer = NULL;
-  if(new){
-    //log_msg(L_DEBUG "New route: %I", net->n.prefix);
-    //log_msg(L_DEBUG "New route: %-1I/%2d ", net->n.prefix, net->n.pxlen);
-    //log_msg(L_DEBUG "KF=%02x PF=%02x pref=%d ", net->n.flags, new->pflags, new->pref);
-    //if (new->attrs->dest == RTD_ROUTER)
-    //  log_msg(" ->%I", new->attrs->gw);
-    if (new->attrs->dest == RTD_ROUTER)
-    {
-      //log_msg(L_DEBUG "<SDN_ANNOUNCE> {\"added\" : [{\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}] }", net->n.prefix, net->n.pxlen, new->attrs->gw);
-      varlen = 33 + 3 + 33 + strlen(addedstring);
-      outbuffer = xmalloc(varlen+1);
-      outbuffer[varlen] = '\0';
-      bsnprintf(outbuffer, varlen, addedstring, net->n.prefix, net->n.pxlen, new->attrs->gw);
-      route_print_to_rhea_socket(RheaSockfd, outbuffer);
-      log_msg(L_DEBUG "%s", outbuffer);
-      //sdn_route_print_to_sockets(p, outbuffer);
-      free(outbuffer);
-    }
-    else
-      {
-      //log_msg(L_DEBUG "<SDN_ANNOUNCE> {\"added\" : [{\"prefix\" : \"%I\", \"mask\" : %d}] }", net->n.prefix, net->n.pxlen); 
-      varlen = 33 + 3 + strlen(addedstring);
-      outbuffer = xmalloc(varlen+1);
-      outbuffer[varlen] = '\0';
-      bsnprintf(outbuffer, varlen, addedstring, net->n.prefix, net->n.pxlen);
-      route_print_to_rhea_socket(RheaSockfd, outbuffer);
-      log_msg(L_DEBUG "%s", outbuffer);
-      //sdn_route_print_to_sockets(p, outbuffer);
-      free(outbuffer);
+  struct sdn_entry *e;
+  u32 nh = 0;
+  int live, action, was;
+  int budget = P->budget.limit && pxlen;
+
+  e = fib_find( &t->fib, &prefix, pxlen );
+  if (e && (e->n.flags & SEF_DELETED))
+    e = NULL;
+
+  /*
+   * The controller sees just the prefix and the next hop. Changes of
+   * anything else (BGP attributes, most often) are no news to it.
+   */
+  if (a) {
+    nh = sdn_rta_nexthop(p, a);
+
+    if (e && (e->n.flags & SEF_STALE))
+      sdn_stale_clear(p, e);
+
+    if (e && (e->nh == nh)) {
+      sdn_nh_put(&P->nexthops, nh);
+      P->suppressed++;
+
+      /* The tag may still move it in or out of the budget */
+      if (budget)
+	sdn_budget_set(&P->budget, e, sdn_budget_rank(p, e, tag));
+      return;
     }
   }
-  else{
-    //log_msg(L_DEBUG "Removing route: %-1I/%2d ", net->n.prefix, net->n.pxlen);
-    //if(old){
-    //  log_msg(L_DEBUG "KF=%02x PF=%02x pref=%d ", net->n.flags, old->pflags, old->pref);
-    //  if (old->attrs->dest == RTD_ROUTER)
-    //    log_msg(" ->%I", old->attrs->gw);
-    //}
-    if (old && old->attrs->dest == RTD_ROUTER)
-    {
-      //log_msg(L_DEBUG "<SDN_ANNOUNCE> {\"removed\" : [{\"prefix\" : \"%I\", \"mask\" : %d, \"via\" : \"%I\"}] }", net->n.prefix, net->n.pxlen, old->attrs->gw);
-      varlen = 33 + 3 + 33 + strlen(removedstring);
-      outbuffer = xmalloc(varlen+1);
-      outbuffer[varlen] = '\0';
-      bsnprintf(outbuffer, varlen, removedstring, net->n.prefix, net->n.pxlen, old->attrs->gw);
-      route_print_to_rhea_socket(RheaSockfd, outbuffer);
-      log_msg(L_DEBUG "%s", outbuffer);
-      //sdn_route_print_to_sockets(p, outbuffer);
-      free(outbuffer);
-    }
-    else
-    {
-      // log_msg(L_DEBUG "<SDN_ANNOUNCE> {\"removed\" : [{\"prefix\" : \"%I\", \"mask\" : %d}] }", net->n.prefix, net->n.pxlen);
-      varlen = 33 + 3 + strlen(removedstring);
-      outbuffer = xmalloc(varlen+1);
-      outbuffer[varlen] = '\0';
-      bsnprintf(outbuffer, varlen, removedstring, net->n.prefix, net->n.pxlen);
-      route_print_to_rhea_socket(RheaSockfd, outbuffer);
-      log_msg(L_DEBUG "%s", outbuffer);
-      //sdn_route_print_to_sockets(p, outbuffer);
-      free(outbuffer);
-    }
+  else if (!e)
+    return;
+
+  live = !!e;
+  if (a) {
+    if (!e)
+      e = fib_get( &t->fib, &prefix, pxlen );
+    sdn_entry_update(p, e, live);
+
+    e->tab = t;
+    sdn_nh_put(&P->nexthops, e->nh);
+    e->nh = nh;
+    if (!live)
+      t->routes++;
+    if (!P_CF->compact)
+      sdn_merkle_add(&t->merkle, e, sdn_entry_hash(p, e));
+    sdn_journal_add(p, e, 0);
+  }
+
+  /* A withdrawal is a flap, so is a change of the next hop, but half as bad */
+  action = sdn_damp_update(p, e, !!a,
+			   a ? (live ? P_CF->damp_penalty / 2 : 0) : P_CF->damp_penalty);
+
+  /*
+   * Routes entering or leaving the budget are announced or withdrawn by
+   * sdn_budget_moved(), this one included. Otherwise, it is sent as usual
+   * if it stays within.
+   */
+  if (budget) {
+    was = e->n.flags & SEF_BUDGET;
+    if (a)
+      sdn_budget_set(&P->budget, e, sdn_budget_rank(p, e, tag));
+    if (!was || (a && !(e->n.flags & SEF_BUDGET)))
+      action = SDN_DAMP_HOLD;
+  }
+
+  /* During the initial feed, the snapshot takes care of everything */
+  if (!P->syncing && (action != SDN_DAMP_HOLD))
+    sdn_batch_add(p, e, !a || (action == SDN_DAMP_WITHDRAW));
+
+  if (!a) {
+    /* Withdrawn first, so that the one taking its place fits */
+    if (budget)
+      sdn_budget_remove(&P->budget, e);
+    sdn_entry_withdraw(p, e);
   }
 }
 
@@ -850,11 +4122,11 @@ sdn_route_mod_str(struct proto *p, struct sdn_entry *e, struct network *net, str
  * own), so store it into our data structures.
  */
 static void
-sdn_rt_notify(struct proto *p, struct rtable *table UNUSED, struct network *net,
+sdn_rt_notify(struct proto *p, struct rtable *table, struct network *net,
 	      struct rte *new, struct rte *old, struct ea_list *attrs)
 {
   CHK_MAGIC;
-  struct sdn_entry *e;
+  struct sdn_table *t = sdn_table_find(p, table);
 
   log_msg(L_DEBUG "Calling sdn_rt_notify");
   /*
@@ -887,43 +4159,184 @@ sdn_rt_notify(struct proto *p, struct rtable *table UNUSED, struct network *net,
    *   ]
    * }
    */
-  // get socket details
-  
-  sdn_route_mod_str(p, e, net, new, old);
 
-  e = fib_find( &P->rtable, &net->n.prefix, net->n.pxlen );
-  if (e)
-    fib_delete( &P->rtable, e );
+  if (P->trace)
+    sdn_trace_write(P->trace, t->id, net, new);
 
-  if (new) {
-    e = fib_get( &P->rtable, &net->n.prefix, net->n.pxlen );
-
-    e->nexthop = new->attrs->gw;
-    e->metric = 0;
-    e->whotoldme = IPA_NONE;
-    new->u.sdn.entry = e;
-
-    e->tag = ea_get_int(attrs, EA_SDN_TAG, 0);
-    e->metric = ea_get_int(attrs, EA_SDN_METRIC, 1);
-    if (e->metric > P_CF->infinity)
-      e->metric = P_CF->infinity;
-
-    if (new->attrs->src->proto == p)
-      e->whotoldme = new->attrs->from;
-
-    if (!e->metric)	/* That's okay: this way user can set his own value for external
-			   routes in sdn. */
-      e->metric = 5;
-    e->updated = e->changed = now;
-    e->flags = 0;
-  }
+  if (!new && sdn_stale_hold(p, t, net, old))
+    return;
+
+  sdn_export(p, t, net->n.prefix, net->n.pxlen, new ? new->attrs : NULL,
+	     new ? ea_get_int(attrs, EA_SDN_TAG, 0) : 0);
+}
+
+/*
+ * Trace replay
+ *
+ * A trace recorded with the record option (see trace.c) is played back
+ * by the sdn replay command through sdn_export(), just as if the core
+ * had sent the events, either keeping the original gaps between them
+ * or as fast as possible. It is only allowed with a mock controller,
+ * which counts what it is sent and drops it, as the replayed routes
+ * must never reach the switches; this measures the export pipeline on
+ * production traffic without a real controller. Gaps of a second or
+ * more wait on a timer; shorter ones are kept by polling the clock from
+ * the event loop, which keeps a CPU busy for the replay.
+ */
+
+#define SDN_REPLAY_BATCH	1024	/* Events played at once */
+
+static void
+sdn_replay_done(struct proto *p, int damaged)
+{
+  struct sdn_replay *r = P->replay;
+  u64 time = sdn_trace_clock() - r->start;
+
+  sdn_batch_flush_all(p);
+  if (damaged)
+    log(L_ERR "%s: Replay of %s stopped at damaged event %lu", p->name, r->name, (unsigned long) r->events);
+  else
+    log(L_INFO "%s: Replay of %s done, %lu events", p->name, r->name, (unsigned long) r->events);
+  log(L_INFO "%s: Replay took %u.%06u s, %lu events skipped, %lu bytes to controller", p->name,
+      (uint) (time / 1000000), (uint) (time % 1000000), (unsigned long) r->skipped,
+      (unsigned long) (sdn_ctl_sent(p) - r->sent));
+
+  sdn_trace_close(r->trace);
+  rfree(r->event);
+  rfree(r->timer);
+  rfree(r->lp);
+  mb_free(r->name);
+  mb_free(r);
+  P->replay = NULL;
+}
+
+static void
+sdn_replay_event(void *data)
+{
+  struct proto *p = data;
+  struct sdn_replay *r = P->replay;
+  struct sdn_table *t;
+  rta a;
+  u64 clock = sdn_trace_clock() - r->start;
+  int n, res;
+
+  for (n = 0; n < SDN_REPLAY_BATCH; n++)
+    {
+      if (!r->ready)
+	{
+	  lp_flush(r->lp);
+	  if ((res = sdn_trace_read(r->trace, &r->ev, r->lp)) <= 0)
+	    {
+	      sdn_replay_done(p, res < 0);
+	      return;
+	    }
+	  r->ready = 1;
+	  r->due += r->ev.delay;
+	}
+
+      if (!r->fast && (r->due > clock))
+	break;
+      r->ready = 0;
+
+      if (!(t = sdn_table_find_id(p, r->ev.table)))
+	{
+	  r->skipped++;
+	  continue;
+	}
+
+      r->events++;
+      if (r->ev.dest == SDN_TRACE_WITHDRAW)
+	sdn_export(p, t, r->ev.prefix, r->ev.pxlen, NULL, 0);
+      else
+	{
+	  memset(&a, 0, sizeof(a));
+	  a.dest = r->ev.dest;
+	  a.gw = r->ev.gw;
+	  a.nexthops = r->ev.nexthops;
+	  sdn_export(p, t, r->ev.prefix, r->ev.pxlen, &a, 0);
+	}
+    }
+
+  if (r->ready && !r->fast && (r->due >= clock + 1000000))
+    tm_start(r->timer, (r->due - clock) / 1000000);
+  else
+    ev_schedule(r->event);
+}
+
+static void
+sdn_replay_timer(timer *t)
+{
+  sdn_timed_replay_event(t->data);
+}
+
+/**
+ * sdn_replay_cmd - start playing back a trace
+ * @p: the protocol
+ * @name: trace file
+ * @fast: do not keep the original pace
+ */
+void
+sdn_replay_cmd(struct proto *p, char *name, int fast)
+{
+  struct sdn_replay *r;
+  struct sdn_trace *trace;
+  char *err;
+
+  if (!p || (p->proto_state != PS_UP))
+    {
+      cli_msg(8005, "Protocol is down");
+      return;
+    }
+
+  /* Replayed routes are not real, they must not reach the switches */
+  if (!P_CF->controller_mock)
+    {
+      cli_msg(8011, "%s: Replay needs controller mock", p->name);
+      return;
+    }
+
+  if (P->replay)
+    {
+      cli_msg(8009, "Replay of %s is already running", P->replay->name);
+      return;
+    }
+
+  if (!(trace = sdn_trace_open(p->pool, name, &err)))
+    {
+      cli_msg(8010, "Cannot open trace %s: %s", name, err);
+      return;
+    }
+
+  r = P->replay = mb_allocz(p->pool, sizeof(struct sdn_replay));
+  r->trace = trace;
+  r->name = mb_alloc(p->pool, strlen(name) + 1);
+  strcpy(r->name, name);
+  r->fast = fast;
+  r->event = ev_new(p->pool);
+  r->event->hook = sdn_timed_replay_event;
+  r->event->data = p;
+  r->timer = tm_new(p->pool);
+  r->timer->hook = sdn_replay_timer;
+  r->timer->data = p;
+  r->lp = lp_new(p->pool, 4080);
+  r->start = sdn_trace_clock();
+  r->sent = sdn_ctl_sent(p);
+  ev_schedule(r->event);
+
+  cli_msg(0, "%s: Replaying %s%s", p->name, name, fast ? " as fast as possible" : "");
 }
 
+/*
+ * sdn_rte_same - a route the controller sends again carries the time
+ * it was sent, so that it replaces the old one instead of being
+ * dropped, and sdn_rte_insert() puts it on the garbage wheel anew.
+ */
 static int
 sdn_rte_same(struct rte *new, struct rte *old)
 {
   /* new->attrs == old->attrs always */
-  return new->u.sdn.metric == old->u.sdn.metric;
+  return (new->u.sdn.metric == old->u.sdn.metric) &&
+    (new->lastmod == old->lastmod);
 }
 
 
@@ -950,9 +4363,9 @@ sdn_rte_better(struct rte *new, struct rte *old)
 }
 
 /*
- * sdn_rte_insert - we maintain linked list of "our" entries in main
- * routing table, so that we can timeout them correctly. sdn_timer()
- * walks the list.
+ * sdn_rte_insert - we keep "our" entries in main routing table on the
+ * garbage timing wheel, so that we can timeout them correctly.
+ * sdn_timer() turns the wheel.
  */
 static void
 sdn_rte_insert(net *net UNUSED, rte *rte)
@@ -960,36 +4373,240 @@ sdn_rte_insert(net *net UNUSED, rte *rte)
   struct proto *p = rte->attrs->src->proto;
   CHK_MAGIC;
   DBG( "sdn_rte_insert: %p\n", rte );
-  add_head( &P->garbage, &rte->u.sdn.garbage );
+  sdn_wheel_add( &P->garbage, &rte->u.sdn.garbage, rte->lastmod + P_CF->timeout_time );
 }
 
 /*
- * sdn_rte_remove - link list maintenance
+ * sdn_rte_remove - wheel maintenance
  */
 static void
 sdn_rte_remove(net *net UNUSED, rte *rte)
 {
-#ifdef LOCAL_DEBUG
   struct proto *p = rte->attrs->src->proto;
   CHK_MAGIC;
   DBG( "sdn_rte_remove: %p\n", rte );
-#endif
-  rem_node( &rte->u.sdn.garbage );
+  sdn_wheel_remove( &P->garbage, &rte->u.sdn.garbage );
+}
+
+static bird_clock_t
+sdn_rte_expires(struct sdn_wheel *w, node *n)
+{
+  struct proto *p = w->data;
+  rte *e = SKIP_BACK(rte, u.sdn.garbage, n);
+
+  return e->lastmod + P_CF->timeout_time;
+}
+
+static void
+sdn_rte_expire(struct sdn_wheel *w, node *n)
+{
+  struct proto *p = w->data;
+  rte *e = SKIP_BACK(rte, u.sdn.garbage, n);
+
+  TRACE(D_EVENTS, "Route %I/%d timed out", e->net->n.prefix, e->net->n.pxlen);
+  rte_update(p, e->net, NULL);
+}
+
+/*
+ * sdn_timer - once a second, expire routes the controller has not
+ * refreshed for timeout_time
+ */
+static void
+sdn_timer(timer *t)
+{
+  struct proto *p = t->data;
+
+  CHK_MAGIC;
+  sdn_wheel_advance( &P->garbage, now );
+  sdn_wheel_advance( &P->reuse, now );
+  sdn_damp_reuse(p);
+  sdn_wheel_advance( &P->retry, now );
+
+  if (P->syncing && (p->export_state == ES_READY))
+  {
+    P->syncing = 0;
+    sdn_send_snapshot(p);
+  }
+
+  /* Give clients which were too slow to take their dumps another chance */
+  if (!EMPTY_LIST(P->connections))
+    ev_schedule( P->dump_event );
+}
+
+/*
+ * Hook accounting
+ *
+ * The core and the sockets call into the protocol through the timed
+ * variants of its hooks below, and so do our own events and timers,
+ * among them the batch flush, which may encode a whole snapshot. Each
+ * call is measured on the monotonic clock and added up per hook. A call
+ * taking longer than the stall limit holds up the whole event loop, so
+ * it is also logged, at a rate limited pace, and counted. show sdn
+ * hooks lists the totals, so that stalls of the main loop can be told
+ * to be ours or not without a profiler. Reading the clock costs a few
+ * tens of nanoseconds.
+ */
+
+static const char *sdn_hook_name[SDN_HOOKS] = {
+  "rt_notify", "import_control", "if_notify", "zeromq_rx", "controller_rx", "timer",
+  "batch_flush", "dump", "replay", "stale_sweep"
+};
+
+static void
+sdn_hook_done(struct proto *p, int hook, u64 start)
+{
+  struct sdn_hook_stat *h = &P->hooks[hook];
+  u64 took = sdn_trace_clock() - start;
+
+  h->calls++;
+  h->total += took;
+  h->max = MAX(h->max, took);
+
+  if (P_CF->stall_limit && (took >= (u64) P_CF->stall_limit * 1000))
+    {
+      h->stalls++;
+      log_rl(&P->rl_stall, L_WARN "%s: Hook %s took %u ms", p->name, sdn_hook_name[hook],
+	     (unsigned) (took / 1000));
+    }
+}
+
+static void
+sdn_timed_rt_notify(struct proto *p, struct rtable *table, struct network *net,
+		    struct rte *new, struct rte *old, struct ea_list *attrs)
+{
+  u64 start = sdn_trace_clock();
+
+  sdn_rt_notify(p, table, net, new, old, attrs);
+  sdn_hook_done(p, SDN_HOOK_NOTIFY, start);
+}
+
+static int
+sdn_timed_import_control(struct proto *p, struct rte **rt, struct ea_list **attrs, struct linpool *pool)
+{
+  u64 start = sdn_trace_clock();
+  int res = sdn_import_control(p, rt, attrs, pool);
+
+  sdn_hook_done(p, SDN_HOOK_IMPORT, start);
+  return res;
+}
+
+static void
+sdn_timed_if_notify(struct proto *p, unsigned c, struct iface *iface)
+{
+  u64 start = sdn_trace_clock();
+
+  sdn_if_notify(p, c, iface);
+  sdn_hook_done(p, SDN_HOOK_IF, start);
+}
+
+static int
+sdn_timed_zmq_rx(zeromq *z, int size)
+{
+  u64 start = sdn_trace_clock();
+  int res = zeromq_rx(z, size);
+
+  sdn_hook_done(z->data, SDN_HOOK_ZMQ, start);
+  return res;
+}
+
+static int
+sdn_timed_ctl_rx(sock *s, int size)
+{
+  u64 start = sdn_trace_clock();
+  int res = sdn_ctl_rx(s, size);
+
+  sdn_hook_done(((struct sdn_controller *) s->data)->proto, SDN_HOOK_CTL, start);
+  return res;
+}
+
+static void
+sdn_timed_timer(timer *t)
+{
+  u64 start = sdn_trace_clock();
+
+  sdn_timer(t);
+  sdn_hook_done(t->data, SDN_HOOK_TIMER, start);
+}
+
+static void
+sdn_timed_batch_event(void *data)
+{
+  u64 start = sdn_trace_clock();
+
+  sdn_batch_event(data);
+  sdn_hook_done(((struct sdn_controller *) data)->proto, SDN_HOOK_FLUSH, start);
+}
+
+static void
+sdn_timed_dump_event(void *data)
+{
+  u64 start = sdn_trace_clock();
+
+  sdn_dump_event(data);
+  sdn_hook_done(data, SDN_HOOK_DUMP, start);
+}
+
+static void
+sdn_timed_replay_event(void *data)
+{
+  u64 start = sdn_trace_clock();
+
+  sdn_replay_event(data);
+  sdn_hook_done(data, SDN_HOOK_REPLAY, start);
+}
+
+static void
+sdn_timed_stale_sweep(timer *tm)
+{
+  u64 start = sdn_trace_clock();
+
+  sdn_stale_sweep(tm);
+  sdn_hook_done(tm->data, SDN_HOOK_SWEEP, start);
+}
+
+/*
+ * sdn_sh_hooks - show time spent in the hooks
+ */
+void
+sdn_sh_hooks(struct proto *p)
+{
+  struct sdn_hook_stat *h;
+  int i;
+
+  if (p->proto_state != PS_UP)
+    {
+      cli_msg(-1021, "%s: is not up", p->name);
+      cli_msg(0, "");
+      return;
+    }
+
+  cli_msg(-1021, "%s:", p->name);
+  cli_msg(-1021, "%-16s %12s %10s %8s %8s %8s", "Hook", "Calls", "Total ms", "Avg us", "Max us", "Stalls");
+  for (i = 0; i < SDN_HOOKS; i++)
+    {
+      h = &P->hooks[i];
+      cli_msg(-1021, "%-16s %12lu %10lu %8lu %8lu %8lu", sdn_hook_name[i], (unsigned long) h->calls,
+	      (unsigned long) (h->total / 1000), (unsigned long) (h->calls ? h->total / h->calls : 0),
+	      (unsigned long) h->max, (unsigned long) h->stalls);
+    }
+  cli_msg(0, "");
 }
 
 void
 sdn_init_instance(struct proto *p)
 {
   p->accept_ra_types = RA_ANY;
-  p->if_notify = sdn_if_notify;
-  p->rt_notify = sdn_rt_notify;
-  p->import_control = sdn_import_control;
+  p->if_notify = sdn_timed_if_notify;
+  p->rt_notify = sdn_timed_rt_notify;
+  p->import_control = sdn_timed_import_control;
   p->make_tmp_attrs = sdn_make_tmp_attrs;
   p->store_tmp_attrs = sdn_store_tmp_attrs;
   p->rte_better = sdn_rte_better;
   p->rte_same = sdn_rte_same;
   p->rte_insert = sdn_rte_insert;
   p->rte_remove = sdn_rte_remove;
+  p->feed_begin = sdn_feed_begin;
+  p->feed_end = sdn_feed_end;
 }
 
 void
@@ -1001,10 +4618,100 @@ sdn_init_config(struct sdn_proto_config *c)
   c->period	= 30;
   c->garbage_time = 120+180;
   c->timeout_time = 120;
+  init_list(&c->tables);
+  init_list(&c->controllers);
+  c->controller = "localhost";
+  c->controller_port = 55650;
+  c->zeromq = "tcp://127.0.0.1:5556";
+  c->damp_half_life = 900;
+  c->damp_reuse = 750;
+  c->damp_suppress = 2000;
+  c->damp_penalty = 1000;
+  c->damp_max_suppress = 3600;
+  c->stall_limit = 100;
+  c->request_size = SDN_REQUEST_SIZE;
   c->passwords	= NULL;
   c->authtype	= AT_NONE;
 }
 
+/* Host names are resolved once, when the configuration is read */
+static void
+sdn_ctl_resolve(struct sdn_ctl_config *c)
+{
+  struct addrinfo hints, *res;
+
+  if (ip_pton(c->host, &c->addr))
+    return;
+
+  memset(&hints, 0, sizeof(hints));
+#ifndef IPV6
+  hints.ai_family = AF_INET;
+#else
+  hints.ai_family = AF_INET6;
+  hints.ai_flags = AI_V4MAPPED;
+#endif
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(c->host, NULL, &hints, &res))
+    cf_error("Cannot resolve controller %s", c->host);
+
+#ifndef IPV6
+  memcpy(&c->addr, &((struct sockaddr_in *) res->ai_addr)->sin_addr, sizeof(ip_addr));
+#else
+  memcpy(&c->addr, &((struct sockaddr_in6 *) res->ai_addr)->sin6_addr, sizeof(ip_addr));
+#endif
+  ipa_ntoh(c->addr);
+  freeaddrinfo(res);
+}
+
+static void
+sdn_postconfig(struct proto_config *cf)
+{
+  struct sdn_proto_config *c = (struct sdn_proto_config *) cf;
+  struct sdn_ctl_config *cc, *x;
+  int n = 0;
+
+  /* Just the one controller unless more are listed */
+  if (EMPTY_LIST(c->controllers))
+    {
+      cc = cfg_allocz(sizeof(struct sdn_ctl_config));
+      cc->host = c->controller;
+      add_tail(&c->controllers, NODE cc);
+    }
+
+  WALK_LIST(cc, c->controllers)
+    {
+      if (!cc->port)
+	cc->port = c->controller_port;
+      for (x = HEAD(c->controllers); x != cc; x = NODE_NEXT(x))
+	if (!strcmp(x->host, cc->host) && (x->port == cc->port))
+	  cf_error("Controller %s port %d listed twice", cc->host, cc->port);
+      if (++n > SDN_CTL_MAX)
+	cf_error("Too many controllers, at most %d", SDN_CTL_MAX);
+      if (!c->controller_mock)
+	sdn_ctl_resolve(cc);
+    }
+}
+
+static void
+sdn_get_status(struct proto *p, byte *buf)
+{
+  char state[32];
+  int i, up = 0;
+
+  if (p->proto_state != PS_UP)
+    return;
+
+  if (P->ring.controllers == 1)
+    {
+      strcpy(buf, sdn_ctl_state(P->ctl[P->ring.single], state));
+      return;
+    }
+
+  for (i = 0; i < SDN_CTL_MAX; i++)
+    up += P->ctl[i] && (P->ctl[i]->state == SDN_CTL_UP);
+  bsprintf(buf, "%d of %d controllers up", up, P->ring.controllers);
+}
+
 static int
 sdn_get_attr(eattr *a, byte *buf, int buflen UNUSED)
 {
@@ -1022,27 +4729,77 @@ sdn_pat_compare(struct sdn_patt *a, struct sdn_patt *b)
 	  (a->mode == b->mode));
 }
 
+static int
+sdn_tables_equal(list *a, list *b)
+{
+  struct sdn_table_config *x, *y;
+
+  for (x = HEAD(*a), y = HEAD(*b); NODE_VALID(x) && NODE_VALID(y); x = NODE_NEXT(x), y = NODE_NEXT(y))
+    if ((x->id != y->id) || strcmp(x->table->name, y->table->name))
+      return 0;
+  return !NODE_VALID(x) && !NODE_VALID(y);
+}
+
 static int
 sdn_reconfigure(struct proto *p, struct proto_config *c)
 {
   struct sdn_proto_config *new = (struct sdn_proto_config *) c;
-  int generic = sizeof(struct proto_config) + sizeof(list) /* + sizeof(struct password_item *) */;
+  int generic = OFFSETOF(struct sdn_proto_config, infinity);
+  struct sdn_table *t;
 
   if (!iface_patts_equal(&P_CF->iface_list, &new->iface_list, (void *) sdn_pat_compare))
     return 0;
-  return !memcmp(((byte *) P_CF) + generic,
-                 ((byte *) new) + generic,
-                 sizeof(struct sdn_proto_config) - generic);
+  if (!sdn_tables_equal(&P_CF->tables, &new->tables) ||
+      strcmp(P_CF->zeromq, new->zeromq) ||
+      (!P_CF->record != !new->record) ||
+      (P_CF->record && strcmp(P_CF->record, new->record)) ||
+      (!P_CF->budget_priority != !new->budget_priority) ||
+      (P_CF->budget_priority && !trie_same(P_CF->budget_priority, new->budget_priority)))
+    return 0;
+  if (memcmp(((byte *) P_CF) + generic,
+             ((byte *) new) + generic,
+             sizeof(struct sdn_proto_config) - generic))
+    return 0;
+
+  /* The core retargets just the main hook, the old filter is freed */
+  WALK_LIST(t, P->tables)
+    if (t->ahook)
+      t->ahook->out_filter = new->c.out_filter;
+
+  /* Controllers can come and go without a restart */
+  sdn_ctl_reconfigure(p, new);
+  return 1;
 }
 
 static void
 sdn_copy_config(struct proto_config *dest, struct proto_config *src)
 {
+  struct sdn_proto_config *d = (struct sdn_proto_config *) dest;
+  struct sdn_proto_config *s = (struct sdn_proto_config *) src;
+  struct sdn_table_config *tc, *n;
+  struct sdn_ctl_config *cc, *m;
+
   /* Shallow copy of everything */
   proto_copy_rest(dest, src, sizeof(struct sdn_proto_config));
 
   /* We clean up iface_list, ifaces are non-sharable */
-  init_list(&((struct sdn_proto_config *) dest)->iface_list);
+  init_list(&d->iface_list);
+
+  init_list(&d->tables);
+  WALK_LIST(tc, s->tables)
+    {
+      n = cfg_alloc(sizeof(struct sdn_table_config));
+      memcpy(n, tc, sizeof(struct sdn_table_config));
+      add_tail(&d->tables, NODE n);
+    }
+
+  init_list(&d->controllers);
+  WALK_LIST(cc, s->controllers)
+    {
+      m = cfg_alloc(sizeof(struct sdn_ctl_config));
+      memcpy(m, cc, sizeof(struct sdn_ctl_config));
+      add_tail(&d->controllers, NODE m);
+    }
 
   /* Copy of passwords is OK, it just will be replaced in dest when used */
 }
@@ -1055,10 +4812,13 @@ struct protocol proto_sdn = {
   preference: DEF_PREF_SDN,
   get_route_info: sdn_get_route_info,
   get_attr: sdn_get_attr,
+  get_status: sdn_get_status,
 
+  postconfig: sdn_postconfig,
   init: sdn_init,
   dump: sdn_dump,
   start: sdn_start,
+  cleanup: sdn_cleanup,
   reconfigure: sdn_reconfigure,
   copy_config: sdn_copy_config
 };
@@ -40,19 +40,43 @@ struct sdn_zeromq_wrapper {
   zeromq* skt;
 };
 
-struct sdn_connection {
+#define SDN_ID_MAX	255	/* ZeroMQ identity length limit */
+#define SDN_REQUEST_SIZE	(16 << 20)	/* Default limit of controller requests */
+#define SDN_REQUEST_MAX		(1 << 30)
+
+struct sdn_connection {		/* A client with a dump in progress */
   node n;
 
   int num;
   struct proto *proto;
-  ip_addr addr;
-  sock *send;
-  struct sdn_interface *rif;
+  zeromq *zq;			/* Endpoint the client talks to */
+  byte id[SDN_ID_MAX];		/* Its ROUTER identity */
+  int idlen;
+  int delim;			/* Uses an empty delimiter frame (REQ) */
+  int gone;			/* Disconnected */
   struct fib_iterator iter;
 
-  ip_addr daddr;
-  int dport;
-  int done;
+  u64 seq;			/* Snapshot being dumped */
+  u64 sent;			/* Last change sent after the snapshot */
+  struct sdn_table *tab;	/* Table being walked */
+  struct sdn_subscription *sub;	/* Routes the client wants, NULL for all */
+  int done;			/* Tables walked, sending changes */
+  int pending;			/* Dumps requested meanwhile */
+};
+
+struct sdn_subscription {	/* Prefixes a client watches */
+  node n;
+
+  zeromq *zq;
+  byte id[SDN_ID_MAX];
+  int idlen;
+  int delim;
+  int gone;
+  int table;			/* Table watched, -1 for all */
+  linpool *lp;			/* Holds the trie */
+  struct f_trie *trie;
+  int count;			/* Patterns in it */
+  u32 lost;			/* Changes dropped as the client was not keeping up */
 };
 
 struct sdn_packet_heading {		/* 4 bytes */
@@ -104,16 +128,125 @@ struct sdn_md5_tail {	/* 20 bytes */
   char md5[16];
 };
 
+/*
+ * Shadow table entries hold just what the controller sees, and that as
+ * tightly as possible. Flags live in n.flags and the length of the
+ * cached record in n.x0. The next hop is an index to
+ * sdn_proto->nexthops, which fits in the padding after the fib_node
+ * together with the position of the entry in its budget heap.
+ */
 struct sdn_entry {
   struct fib_node n;
+#define SEF_DELETED	1	/* Withdrawn, kept as a tombstone for running dumps */
+#define SEF_COW		2	/* Has older versions, see sdn_proto->cow */
+#define SEF_STATUS	0x0c	/* What the controller made of the route: */
+#define SEF_PENDING	0x00	/*   no word yet */
+#define SEF_INSTALLED	0x04
+#define SEF_REJECTED	0x08
+#define SEF_FULL	0x0c	/*   no room in its flow table */
+#define SEF_RETRY	0x10	/* Has a struct sdn_retry */
+#define SEF_RANKED	0x20	/* Competes for the flow table budget, see budget.c */
+#define SEF_BUDGET	0x40	/* Within the budget */
+#define SEF_STALE	0x80	/* Withdrawn, but RheaFlow not told until the sweep */
+  u32 nh;			/* Next hop, 0 for none */
+  u32 slot;			/* Position in its budget heap */
+  struct sdn_table *tab;
+};
 
-  ip_addr whotoldme;
-  ip_addr nexthop;
-  int metric;
-  u16 tag;
+/*
+ * Consistent dumps, the hash tree, dampening and the record cache need
+ * more per entry. It follows the entry in the same fib node, unless the
+ * protocol is compact, in which case they are not available.
+ */
+struct sdn_entry_ext {
+  u64 gen;			/* Sequence number of the last change */
+  struct sdn_version *old;	/* Older states, newest first */
+  node leaf;			/* In its hash tree leaf, if live */
+  struct sdn_damp *damp;	/* Flap history, keeps the entry even if withdrawn */
+  char *rec;			/* Encoded record, NULL if not cached */
+};
+
+#define SDN_EXT(e)		((struct sdn_entry_ext *) ((e) + 1))
+#define SDN_EXT_ENTRY(x)	(((struct sdn_entry *) (x)) - 1)
+
+struct sdn_version {		/* State of an entry preserved for a snapshot */
+  struct sdn_version *next;
+  u64 gen;
+  int deleted;
+  u32 nh;			/* Holds a reference */
+};
+
+struct sdn_cow {		/* Entry with versions or a tombstone */
+  node n;
+  struct sdn_entry *e;
+};
+
+struct sdn_damp {		/* Flap history of a prefix */
+  node n;			/* On the reuse wheel */
+  node batch;			/* In sdn_proto->reused */
+  struct sdn_entry *e;
+  u32 penalty;			/* Figure of merit as of last */
+  bird_clock_t last;
+  bird_clock_t when;		/* Next check on the wheel */
+  byte suppressed;		/* Changes are not sent to the controller */
+  byte told;			/* The controller has the route */
+};
 
-  bird_clock_t updated, changed;
-  int flags;
+struct sdn_retry {		/* Route the controller failed to install */
+  node n;			/* On the retry wheel */
+  struct sdn_entry *e;
+  bird_clock_t when;		/* Next attempt */
+  byte tries;
+};
+
+#define SDN_HOOK_NOTIFY		0	/* Hooks and events timed, see sdn_hook_done() */
+#define SDN_HOOK_IMPORT		1
+#define SDN_HOOK_IF		2
+#define SDN_HOOK_ZMQ		3
+#define SDN_HOOK_CTL		4
+#define SDN_HOOK_TIMER		5
+#define SDN_HOOK_FLUSH		6
+#define SDN_HOOK_DUMP		7
+#define SDN_HOOK_REPLAY		8
+#define SDN_HOOK_SWEEP		9
+#define SDN_HOOKS		10
+
+struct sdn_hook_stat {		/* Time spent in a hook, in microseconds */
+  u64 calls;
+  u64 total;
+  u64 max;
+  u64 stalls;			/* Calls over the stall limit */
+};
+
+struct sdn_heap_item {
+  struct sdn_entry *e;
+  u32 rank;
+};
+
+struct sdn_heap {		/* Binary heap of ranked entries */
+  struct sdn_heap_item *item;
+  u32 count, size;
+  int max;			/* Best on top, else worst on top */
+};
+
+struct sdn_budget {		/* Flow table budget, see budget.c */
+  struct sdn_heap in;		/* Routes sent to the controller */
+  struct sdn_heap out;		/* The rest */
+  u32 limit;			/* 0 for no budget */
+  u64 moves;			/* Routes moved in or out */
+  pool *pool;
+  void (*moved)(struct sdn_budget *, struct sdn_entry *, int in);
+  void *data;
+};
+
+struct sdn_delta {		/* Change made while a dump is running */
+  node n;
+  u64 seq;
+  u32 table;
+  ip_addr prefix;
+  byte pxlen;
+  byte removed;
+  u32 nh;			/* Holds a reference */
 };
 
 struct sdn_packet {
@@ -125,7 +258,7 @@ struct sdn_interface {
   node n;
   struct proto *proto;
   struct iface *iface;
-  sock *sock;
+  sock *sock;			/* NULL with the shared socket */
   struct sdn_connection *busy;
   int metric;			/* You don't want to put struct sdn_patt *patt here -- think about reconfigure */
   int mode;
@@ -148,17 +281,47 @@ struct sdn_patt {
   int ttl_security;	/* bool + 2 for TX only (send, but do not check on RX) */
 };
 
+struct sdn_table_config {
+  node n;
+  struct rtable_config *table;
+  u32 id;
+};
+
 struct sdn_proto_config {
   struct proto_config c;
   list iface_list;	/* Patterns configured -- keep it first; see sdn_reconfigure why */
   list *passwords;	/* Passwords, keep second */
+  list tables;		/* Extra tables to export (struct sdn_table_config) */
+  list controllers;	/* RheaFlow instances (struct sdn_ctl_config) */
+  char *controller;	/* RheaFlow host, unless more are listed */
+  char *zeromq;		/* URL of our ZeroMQ endpoint */
+  char *record;		/* Trace file for route events, NULL if none */
+  struct f_trie *budget_priority;	/* Prefixes ranked first, NULL if none */
 
   int infinity;		/* User configurable data; must be comparable with memcmp */
   int port;
+  int controller_port;
   int period;
   int garbage_time;
   int timeout_time;
   char *unixsocket;
+  int initial_snapshot;	/* Send one snapshot after the initial feed */
+  int shared_socket;	/* One socket for all interfaces */
+  int controller_mock;	/* Discard what would go to the controller */
+  int encode_threads;	/* For big snapshots, 0 for one per CPU */
+  int damping;			/* Route flap dampening of controller exports */
+  int damp_half_life;
+  int damp_reuse;
+  int damp_suppress;
+  int damp_penalty;		/* Per withdrawal, half of it per next hop change */
+  int damp_max_suppress;
+  int budget;			/* Routes sent to the controller, 0 for all */
+  int budget_tag;		/* Rank by EA_SDN_TAG */
+  int budget_longer;		/* Prefer longer prefixes to shorter ones */
+  int stale_time;		/* Withdrawals of a session reset held back for, 0 for none */
+  int stall_limit;		/* Milliseconds a hook may take unreported, 0 for any */
+  int request_size;		/* Longest controller request taken, in bytes */
+  int compact;			/* Entries without struct sdn_entry_ext */
 
   int authtype;
 #define AT_NONE 0
@@ -170,19 +333,203 @@ struct sdn_proto_config {
 #define HO_ALWAYS 2
 };
 
+#define SDN_WHEEL_BITS		6
+#define SDN_WHEEL_SLOTS		(1 << SDN_WHEEL_BITS)
+#define SDN_WHEEL_LEVELS	4	/* 2^24 seconds */
+
+struct sdn_wheel {
+  list slot[SDN_WHEEL_LEVELS][SDN_WHEEL_SLOTS];
+  bird_clock_t base;		/* First second not processed yet */
+  unsigned count;
+  bird_clock_t (*expires)(struct sdn_wheel *, node *);
+  void (*expire)(struct sdn_wheel *, node *);
+  void *data;
+};
+
+#define SDN_MERKLE_BITS		12
+#define SDN_MERKLE_LEAVES	(1 << SDN_MERKLE_BITS)
+
+struct sdn_merkle {		/* Hash tree over the shadow table, see merkle.c */
+  u64 *hash;			/* Digests of nodes, in heap order from 1 */
+  u32 *count;			/* Live entries under each node */
+  list *leaf;			/* Entries of each leaf */
+};
+
+struct sdn_group_hop {
+  ip_addr gw;
+  u32 weight;			/* 1 to 256 */
+};
+
+struct sdn_group {		/* Next hops of a multipath route */
+  u64 hash;
+  int count;
+  u32 told;			/* Defined to RheaFlow, a bit per controller ID */
+  struct sdn_group_hop hop[0];	/* Sorted by address, then weight */
+};
+
+#define SDN_GROUP_SIZE(n)	(48 + (n) * (32 + STD_ADDRESS_P_LENGTH) + SDN_ENCODE_SLACK)
+
+struct sdn_nexthop {		/* Interned next hop, see nexthop.c */
+  ip_addr addr;			/* IPA_NONE for a group */
+  u32 uses;			/* Entries using it, 0 if free */
+  u32 next;			/* Next in hash chain or free list */
+  struct sdn_group *group;	/* Multipath next hops, NULL for a single one */
+};
+
+struct sdn_nexthops {
+  struct sdn_nexthop *nh;	/* Indexed by the number, 0 stands for none */
+  u32 *hash;			/* Chains by index, 0 terminated */
+  u32 size;			/* Slots allocated */
+  u32 used;			/* Slots ever handed out */
+  u32 count;			/* Next hops in use */
+  u32 groups;			/* Of them groups */
+  u32 free;			/* First free slot, 0 if none */
+  int order;			/* log2 of hash size */
+  pool *pool;
+};
+
+#define sdn_nh_addr(t, i)	((t)->nh[i].addr)
+#define sdn_nh_group(t, i)	((t)->nh[i].group)
+
+struct sdn_table {		/* A BIRD table we export */
+  node n;
+  u32 id;			/* Carried in every record */
+  struct rtable *table;
+  struct announce_hook *ahook;	/* NULL for the main table */
+  struct fib fib;		/* Shadow table */
+  struct sdn_merkle merkle;	/* Its digests, unless compact */
+  u32 routes;			/* Live entries */
+};
+
+struct sdn_trace_event {	/* Route event read from a trace, see trace.c */
+  u32 delay;			/* Microseconds since the previous one */
+  u32 table;
+  ip_addr prefix;
+  int pxlen;
+  int dest;			/* RTD_* of the route, or: */
+#define SDN_TRACE_WITHDRAW	0xff
+  ip_addr gw;
+  struct mpnh *nexthops;
+};
+
+struct sdn_replay {		/* Trace being played back */
+  struct sdn_trace *trace;
+  char *name;
+  int fast;			/* As fast as possible, not at the original pace */
+  event *event;
+  timer *timer;
+  linpool *lp;
+  u64 start;			/* Clock when started */
+  u64 due;			/* Time of the next event since start */
+  struct sdn_trace_event ev;	/* The next event */
+  int ready;			/* ev is valid */
+  u64 events, skipped;
+  u64 sent;			/* Bytes to the controller before */
+};
+
+#define SDN_CTL_MAX	32		/* Controllers, see ring.c */
+#define SDN_RING_POINTS	64		/* Ring points per controller */
+
+struct sdn_ctl_config {		/* A RheaFlow instance */
+  node n;
+  char *host;
+  int port;			/* 0 for the controller port option */
+  ip_addr addr;			/* Resolved from host */
+};
+
+struct sdn_ring_point {
+  u32 hash;
+  u32 id;			/* Controller */
+};
+
+struct sdn_ring {		/* Consistent hash ring of controllers */
+  struct sdn_ring_point *point;	/* Sorted by hash */
+  int count;
+  int controllers;
+  int single;			/* ID of the controller, if just one */
+};
+
+#define SDN_BATCH_SIZE	65536
+#define SDN_BATCH_MAX	(64 * SDN_BATCH_SIZE)	/* Resync rather than queue more */
+
+struct sdn_controller {		/* Connection to a RheaFlow instance, shared by all tables */
+  struct proto *proto;
+  struct sdn_ctl_config *cf;
+  int id;			/* Index to sdn_proto->ctl and bit in sdn_group->told */
+  sock *sk;			/* NULL while waiting to retry */
+  int state;			/* SDN_CTL_* */
+#define SDN_CTL_RETRY		0
+#define SDN_CTL_CONNECTING	1
+#define SDN_CTL_UP		2
+  timer *retry;
+  unsigned backoff;		/* Seconds to wait after the next failure */
+  u32 connects;			/* Times we have got through */
+  char *buf;			/* Announcements waiting to be sent */
+  int len, size;
+  char *out;			/* Announcements being written out */
+  int out_size;
+  byte busy;			/* The socket is writing out */
+  byte resync;			/* Send a snapshot as soon as the socket is free */
+  u64 sent;			/* Bytes handed over, or discarded by the mock */
+  u64 records;			/* Routes sent, snapshots included */
+  int open;			/* Kind of the message being filled in, if any */
+  int count;			/* Records in it */
+  event *flush;
+};
+
 struct sdn_proto {
   struct proto inherited;
   timer *timer;
-  list connections;
-  struct fib rtable;
-  list garbage;
+  list connections;		/* Dumps in progress */
+  list subscriptions;
+  list tables;			/* Exported tables (struct sdn_table), the main one first */
+  struct sdn_controller *ctl[SDN_CTL_MAX];	/* By ID, NULL if unused */
+  struct sdn_ring ring;		/* Which controller gets which route */
+  struct sdn_wheel garbage;	/* Our own routes, aged by lastmod */
   list interfaces;	/* Interfaces we really know about */
+  struct sdn_interface **if_index;	/* The same by interface index */
+  unsigned if_size;
+  sock *shared;		/* Socket shared by all interfaces, if configured */
+  struct object_lock *shared_lock;
   list sockets;
+  linpool *push_pool;	/* Scratch memory for controller push requests */
+  u64 seq;		/* Last change of any shadow table */
+  u64 snap_max;		/* Newest snapshot being walked, 0 if none */
+  list journal;		/* Changes made while dumps are running */
+  list cow;		/* Entries with versions and tombstones */
+  slab *version_slab, *delta_slab, *cow_slab;
+  slab *rec_slab;	/* Cached records of entries, see sdn_entry_record() */
+  u32 rec_count;
+  struct sdn_nexthops nexthops;
+  event *dump_event;
+  int dump_count;
+  int syncing;		/* Initial feed in progress, see sdn_send_snapshot() */
+  u64 suppressed;	/* Exports dropped as no change to the controller */
+  struct sdn_wheel reuse;	/* Flap histories, by next check */
+  list reused;		/* Prefixes just released from suppression */
+  slab *damp_slab;
+  u32 damp_ceiling;	/* Highest penalty, decays to reuse in max suppress time */
+  int damp_count;	/* Prefixes suppressed */
+  u32 status_count[4];	/* Entries by SEF_STATUS >> 2, pending ones not counted */
+  struct sdn_wheel retry;	/* Failed routes, by next attempt */
+  slab *retry_slab;
+  u64 retried;		/* Announcements sent again */
+  struct sdn_budget budget;
+  timer *stale_timer;		/* Sweeps stale entries */
+  bird_clock_t stale_until;	/* End of the refresh for a session reset, 0 if none */
+  int stale_feed;		/* A refeed of ours is going on */
+  u32 stale_count;		/* Entries marked stale */
+  u64 stale_kept, stale_swept;	/* Marks cleared by announcements, by the sweep */
+  struct sdn_hook_stat hooks[SDN_HOOKS];
+  struct rate_limit rl_stall;
 #ifdef LOCAL_DEBUG
   int magic;
 #endif
   int tx_count;		/* Do one regular update once in a while */
   int rnd_count;	/* Randomize sending time */
+  struct sdn_trace *trace;	/* Route events are recorded to */
+  struct sdn_replay *replay;	/* Running replay, if any */
+  int threads;			/* Encoding threads */
 };
 
 #ifdef LOCAL_DEBUG
@@ -195,6 +542,93 @@ struct sdn_proto {
 
 void sdn_init_instance(struct proto *p);
 void sdn_init_config(struct sdn_proto_config *c);
+void sdn_sh(struct proto *p);
+void sdn_sh_hooks(struct proto *p);
+void sdn_replay_cmd(struct proto *p, char *name, int fast);
+
+/* Timing wheel */
+
+void sdn_wheel_init(struct sdn_wheel *w, bird_clock_t base);
+void sdn_wheel_add(struct sdn_wheel *w, node *n, bird_clock_t when);
+void sdn_wheel_update(struct sdn_wheel *w, node *n, bird_clock_t when);
+void sdn_wheel_remove(struct sdn_wheel *w, node *n);
+void sdn_wheel_advance(struct sdn_wheel *w, bird_clock_t to);
+
+/* Hash tree */
+
+u64 sdn_merkle_hash(ip_addr prefix, int pxlen, ip_addr nexthop);
+u64 sdn_merkle_hash_group(ip_addr prefix, int pxlen, struct sdn_group *g);
+unsigned sdn_merkle_leaf(ip_addr prefix);
+void sdn_merkle_init(struct sdn_merkle *m, pool *pool);
+void sdn_merkle_add(struct sdn_merkle *m, struct sdn_entry *e, u64 hash);
+void sdn_merkle_remove(struct sdn_merkle *m, struct sdn_entry *e, u64 hash);
+
+/* Next hop table */
+
+void sdn_nh_init(struct sdn_nexthops *t, pool *pool);
+u32 sdn_nh_get(struct sdn_nexthops *t, ip_addr a);
+u32 sdn_nh_get_group(struct sdn_nexthops *t, struct mpnh *nhs);
+void sdn_nh_hold(struct sdn_nexthops *t, u32 i);
+void sdn_nh_put(struct sdn_nexthops *t, u32 i);
+
+/* Controller ring */
+
+u32 sdn_ring_hash(ip_addr prefix, int pxlen);
+void sdn_ring_build(struct sdn_ring *r, pool *pool, struct sdn_controller **ctl);
+int sdn_ring_owner(struct sdn_ring *r, u32 hash);
+
+/* Flow table budget */
+
+void sdn_budget_init(struct sdn_budget *b, pool *pool, u32 limit);
+void sdn_budget_set(struct sdn_budget *b, struct sdn_entry *e, u32 rank);
+void sdn_budget_remove(struct sdn_budget *b, struct sdn_entry *e);
+
+/*
+ * Whether the controller is to see @e, @budget is the limit if any and
+ * @ext tells whether entries have struct sdn_entry_ext
+ */
+static inline int
+sdn_entry_exported(struct sdn_entry *e, u32 budget, int ext)
+{
+  struct sdn_damp *d = ext ? SDN_EXT(e)->damp : NULL;
+
+  if ((e->n.flags & SEF_DELETED) || (d && d->suppressed))
+    return 0;
+  return !budget || !e->n.pxlen || (e->n.flags & SEF_BUDGET);
+}
+
+/* Record encoder */
+
+#define SDN_ENCODE_SLACK	4	/* Bytes the encoders may scribble past their output */
+#define SDN_PUT(buf, str)	(memcpy(buf, str, sizeof(str) - 1), (buf) + sizeof(str) - 1)
+#define SDN_REC_SIZE		(sizeof("{\"table\" : 4294967295, \"prefix\" : \"\", \"mask\" : 128, \"via\" : \"\"}") + \
+				 2 * STD_ADDRESS_P_LENGTH + SDN_ENCODE_SLACK)	/* Room for a route record */
+
+void sdn_encode_init(void);
+char *sdn_put_uint(char *buf, u64 v);
+char *sdn_put_ip(char *buf, ip_addr a);
+char *sdn_put_route(char *buf, u32 table, ip_addr prefix, int pxlen, ip_addr *via);
+char *sdn_put_route_group(char *buf, u32 table, ip_addr prefix, int pxlen, u32 group);
+char *sdn_put_group(char *buf, u32 id, struct sdn_group *g);
+
+/* Parallel encoding */
+
+#define SDN_THREADS_MAX		32
+
+int sdn_encode_table(struct fib *fib, u32 table, struct sdn_nexthops *nh, u32 budget, int ext,
+		     struct sdn_ring *ring, int owner, int threads,
+		     void (*emit)(void *data, char *buf, int len, int count), void *data);
+int sdn_encode_threads(int want);
+
+/* Route event traces */
+
+struct sdn_trace;
+u64 sdn_trace_clock(void);
+struct sdn_trace *sdn_trace_create(pool *pool, char *name);
+struct sdn_trace *sdn_trace_open(pool *pool, char *name, char **err);
+void sdn_trace_close(struct sdn_trace *t);
+void sdn_trace_write(struct sdn_trace *t, u32 table, net *n, rte *new);
+int sdn_trace_read(struct sdn_trace *t, struct sdn_trace_event *ev, linpool *lp);
 
 /* Authentication functions */
 
@@ -0,0 +1,207 @@
+/*
+ *	BIRD -- SDN Parallel Encoding
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Parallel encoding
+ *
+ * A full snapshot of a big shadow table takes one core a good while to
+ * encode, so large tables are encoded by several threads instead. The
+ * hash table of the fib is cut into shards, equal ranges of buckets,
+ * several per thread. Each thread takes the next shard nobody has taken
+ * yet and encodes it into a buffer of its own, while the main thread
+ * does the same and then waits for the others. The shard buffers are
+ * then handed to the caller in shard order, so the output is exactly
+ * what a single pass over the fib would give.
+ *
+ * The threads only read: the main thread does nothing else meanwhile,
+ * records already cached in entries are copied and the rest encoded
+ * without caching them, and no next hop references are taken. BIRD
+ * resources are not thread safe, so the shard buffers come from
+ * xmalloc(). All signals are blocked in the threads so that they keep
+ * being delivered to the main one.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "lib/resource.h"
+
+#include "sdn.h"
+
+#define SDN_SHARDS_PER_THREAD	4
+
+struct sdn_shard {
+  unsigned first, last;		/* Buckets of the fib */
+  char *buf;			/* Records, separated by ", " */
+  int len, size, count;
+};
+
+struct sdn_shard_job {
+  struct fib *fib;
+  u32 table;
+  struct sdn_nexthops *nh;
+  u32 budget;
+  int ext;			/* Entries have struct sdn_entry_ext */
+  struct sdn_ring *ring;	/* Just routes of this owner, if any */
+  int owner;
+  struct sdn_shard *shard;
+  int count;
+  int next;			/* First shard not taken yet */
+  pthread_mutex_t lock;
+};
+
+static void
+sdn_shard_encode(struct sdn_shard_job *j, struct sdn_shard *s)
+{
+  struct sdn_entry *e;
+  struct fib_node *fn;
+  unsigned i;
+  char *pos;
+
+  s->size = 65536;
+  s->buf = xmalloc(s->size);
+
+  for (i = s->first; i < s->last; i++)
+    for (fn = j->fib->hash_table[i]; fn; fn = fn->next)
+      {
+	e = (struct sdn_entry *) fn;
+	if (!sdn_entry_exported(e, j->budget, j->ext))
+	  continue;
+	if (j->ring && (sdn_ring_owner(j->ring, sdn_ring_hash(fn->prefix, fn->pxlen)) != j->owner))
+	  continue;
+
+	if (s->len + (int) SDN_REC_SIZE + 2 > s->size)
+	  {
+	    s->size *= 2;
+	    s->buf = xrealloc(s->buf, s->size);
+	  }
+
+	pos = s->buf + s->len;
+	if (s->count++)
+	  pos = SDN_PUT(pos, ", ");
+
+	if (j->ext && SDN_EXT(e)->rec)
+	  {
+	    memcpy(pos, SDN_EXT(e)->rec, e->n.x0);
+	    pos += e->n.x0;
+	  }
+	else if (!e->nh)
+	  pos = sdn_put_route(pos, j->table, fn->prefix, fn->pxlen, NULL);
+	else if (sdn_nh_group(j->nh, e->nh))
+	  pos = sdn_put_route_group(pos, j->table, fn->prefix, fn->pxlen, e->nh);
+	else
+	  pos = sdn_put_route(pos, j->table, fn->prefix, fn->pxlen, &j->nh->nh[e->nh].addr);
+	s->len = pos - s->buf;
+      }
+}
+
+static void *
+sdn_shard_worker(void *data)
+{
+  struct sdn_shard_job *j = data;
+  int i;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&j->lock);
+      i = j->next++;
+      pthread_mutex_unlock(&j->lock);
+
+      if (i >= j->count)
+	return NULL;
+      sdn_shard_encode(j, &j->shard[i]);
+    }
+}
+
+/**
+ * sdn_encode_table - encode all routes of a shadow table in parallel
+ * @fib: the shadow table
+ * @table: its ID
+ * @nh: next hop table
+ * @budget: flow table budget, 0 for none
+ * @ext: whether entries have struct sdn_entry_ext
+ * @ring: controller ring, %NULL to encode routes of all controllers
+ * @owner: the controller to encode routes of
+ * @threads: threads to use, the calling one included
+ * @emit: called with the records of each shard in order
+ * @data: passed to @emit
+ *
+ * Entries which are deleted, suppressed by dampening or outside the
+ * budget are left out, and so are routes of other controllers.
+ * Returns the number of records.
+ */
+int
+sdn_encode_table(struct fib *fib, u32 table, struct sdn_nexthops *nh, u32 budget, int ext,
+		 struct sdn_ring *ring, int owner, int threads,
+		 void (*emit)(void *data, char *buf, int len, int count), void *data)
+{
+  struct sdn_shard_job j;
+  pthread_t tid[SDN_THREADS_MAX];
+  sigset_t all, old;
+  unsigned step;
+  int i, started = 0, n = 0;
+
+  threads = MIN(MAX(threads, 1), SDN_THREADS_MAX);
+  memset(&j, 0, sizeof(j));
+  j.fib = fib;
+  j.table = table;
+  j.nh = nh;
+  j.budget = budget;
+  j.ext = ext;
+  j.ring = ring;
+  j.owner = owner;
+  j.count = MIN(threads * SDN_SHARDS_PER_THREAD, (int) fib->hash_size);
+  j.shard = xmalloc(j.count * sizeof(struct sdn_shard));
+  pthread_mutex_init(&j.lock, NULL);
+
+  step = fib->hash_size / j.count;
+  for (i = 0; i < j.count; i++)
+    {
+      memset(&j.shard[i], 0, sizeof(struct sdn_shard));
+      j.shard[i].first = i * step;
+      j.shard[i].last = (i == j.count - 1) ? fib->hash_size : (i + 1) * step;
+    }
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (i = 1; i < threads; i++)
+    if (!pthread_create(&tid[started], NULL, sdn_shard_worker, &j))
+      started++;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  /* If no thread could be started, we just do it all ourselves */
+  sdn_shard_worker(&j);
+  for (i = 0; i < started; i++)
+    pthread_join(tid[i], NULL);
+  pthread_mutex_destroy(&j.lock);
+
+  for (i = 0; i < j.count; i++)
+    {
+      if (j.shard[i].count)
+	emit(data, j.shard[i].buf, j.shard[i].len, j.shard[i].count);
+      n += j.shard[i].count;
+      xfree(j.shard[i].buf);
+    }
+  xfree(j.shard);
+  return n;
+}
+
+/**
+ * sdn_encode_threads - how many threads to encode with
+ * @want: configured number, 0 for one per CPU
+ */
+int
+sdn_encode_threads(int want)
+{
+  long cpus;
+
+  if (!want)
+    want = ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0) ? cpus : 1;
+  return MIN(want, SDN_THREADS_MAX);
+}
@@ -0,0 +1,259 @@
+/*
+ *	BIRD -- SDN Route Event Traces
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Route event traces
+ *
+ * To benchmark the export pipeline against the bursts seen in
+ * production (session resets, policy pushes), the protocol can record
+ * every route change the core tells it about to a trace file, and play
+ * a trace back later.
+ *
+ * A trace is a header followed by one record per event, all numbers in
+ * network byte order. The header holds a magic number, a version and
+ * the address family. A record holds the time since the previous one in
+ * microseconds, the ID of the table, the prefix, the gateway, the
+ * prefix length, the destination type of the route (%SDN_TRACE_WITHDRAW
+ * for a withdrawal) and the number of multipath next hops that follow
+ * it, each an address and a weight. An IPv4 event without multipath
+ * thus takes 20 bytes. Records are written through the stdio buffer, so
+ * the recording costs little more than a memcpy() per event.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "nest/bird.h"
+#include "nest/route.h"
+#include "lib/resource.h"
+#include "lib/unaligned.h"
+#include "sysdep/unix/unix.h"
+
+#include "sdn.h"
+
+#define SDN_TRACE_MAGIC		0x53444e54	/* "SDNT" */
+#define SDN_TRACE_VERSION	1
+#define SDN_TRACE_IPV6		1		/* Header flags */
+
+#define SDN_TRACE_HEAD_SIZE	12
+#define SDN_TRACE_REC_SIZE	(12 + 2 * sizeof(ip_addr))
+#define SDN_TRACE_HOP_SIZE	(sizeof(ip_addr) + 1)
+#define SDN_TRACE_HOPS_MAX	255
+
+#ifndef IPV6
+#define SDN_TRACE_FAMILY	0
+#else
+#define SDN_TRACE_FAMILY	SDN_TRACE_IPV6
+#endif
+
+struct sdn_trace {
+  struct rfile *rf;
+  FILE *f;
+  u64 last;			/* Time of the last record written */
+  int failed;
+};
+
+/**
+ * sdn_trace_clock - monotonic time in microseconds
+ */
+u64
+sdn_trace_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline byte *
+sdn_trace_put_ip(byte *buf, ip_addr a)
+{
+  ipa_hton(a);
+  memcpy(buf, &a, sizeof(a));
+  return buf + sizeof(a);
+}
+
+static inline byte *
+sdn_trace_get_ip(byte *buf, ip_addr *a)
+{
+  memcpy(a, buf, sizeof(*a));
+  ipa_ntoh(*a);
+  return buf + sizeof(*a);
+}
+
+/**
+ * sdn_trace_create - start a new trace
+ * @pool: pool to allocate it from
+ * @name: file name
+ *
+ * Returns %NULL with errno set if the file cannot be created.
+ */
+struct sdn_trace *
+sdn_trace_create(pool *pool, char *name)
+{
+  struct sdn_trace *t;
+  byte head[SDN_TRACE_HEAD_SIZE];
+  struct rfile *rf;
+
+  if (!(rf = rf_open(pool, name, "w")))
+    return NULL;
+
+  t = mb_allocz(pool, sizeof(struct sdn_trace));
+  t->rf = rf;
+  t->f = rf_file(rf);
+  t->last = sdn_trace_clock();
+
+  put_u32(head, SDN_TRACE_MAGIC);
+  put_u16(head + 4, SDN_TRACE_VERSION);
+  put_u16(head + 6, SDN_TRACE_FAMILY);
+  put_u32(head + 8, now_real);
+  fwrite(head, sizeof(head), 1, t->f);
+  return t;
+}
+
+/**
+ * sdn_trace_open - open a trace for replay
+ * @pool: pool to allocate it from
+ * @name: file name
+ * @err: what went wrong if it cannot be opened
+ */
+struct sdn_trace *
+sdn_trace_open(pool *pool, char *name, char **err)
+{
+  struct sdn_trace *t;
+  byte head[SDN_TRACE_HEAD_SIZE];
+  struct rfile *rf;
+
+  if (!(rf = rf_open(pool, name, "r")))
+    {
+      *err = strerror(errno);
+      return NULL;
+    }
+
+  if (fread(head, sizeof(head), 1, rf_file(rf)) != 1)
+    *err = "Not a trace";
+  else if (get_u32(head) != SDN_TRACE_MAGIC)
+    *err = "Not a trace";
+  else if (get_u16(head + 4) != SDN_TRACE_VERSION)
+    *err = "Unsupported trace version";
+  else if ((get_u16(head + 6) & SDN_TRACE_IPV6) != SDN_TRACE_FAMILY)
+    *err = "Trace of another address family";
+  else
+    {
+      t = mb_allocz(pool, sizeof(struct sdn_trace));
+      t->rf = rf;
+      t->f = rf_file(rf);
+      return t;
+    }
+
+  rfree(rf);
+  return NULL;
+}
+
+/**
+ * sdn_trace_close - close a trace, writing out what is buffered
+ * @t: the trace
+ */
+void
+sdn_trace_close(struct sdn_trace *t)
+{
+  rfree(t->rf);
+  mb_free(t);
+}
+
+/**
+ * sdn_trace_write - record a route event
+ * @t: the trace
+ * @table: ID of the table
+ * @n: network
+ * @new: the route, %NULL for a withdrawal
+ */
+void
+sdn_trace_write(struct sdn_trace *t, u32 table, net *n, rte *new)
+{
+  byte buf[SDN_TRACE_REC_SIZE + SDN_TRACE_HOPS_MAX * SDN_TRACE_HOP_SIZE], *pos, *hops;
+  rta *a = new ? new->attrs : NULL;
+  struct mpnh *nh;
+  u64 clock = sdn_trace_clock();
+  int i = 0;
+
+  if (t->failed)
+    return;
+
+  put_u32(buf, MIN(clock - t->last, 0xffffffff));
+  put_u32(buf + 4, table);
+  t->last = clock;
+
+  pos = sdn_trace_put_ip(buf + 8, n->n.prefix);
+  pos = sdn_trace_put_ip(pos, (a && (a->dest == RTD_ROUTER)) ? a->gw : IPA_NONE);
+  pos[0] = n->n.pxlen;
+  pos[1] = a ? a->dest : SDN_TRACE_WITHDRAW;
+  pos[3] = 0;
+  hops = pos + 2;
+  pos += 4;
+
+  if (a && (a->dest == RTD_MULTIPATH))
+    for (nh = a->nexthops; nh && (i < SDN_TRACE_HOPS_MAX); nh = nh->next, i++)
+      {
+	pos = sdn_trace_put_ip(pos, nh->gw);
+	*pos++ = nh->weight;
+      }
+  *hops = i;
+
+  if (fwrite(buf, pos - buf, 1, t->f) != 1)
+    {
+      log(L_ERR "Cannot write SDN trace: %m");
+      t->failed = 1;
+    }
+}
+
+/**
+ * sdn_trace_read - read the next event of a trace
+ * @t: the trace
+ * @ev: where to put it
+ * @lp: linpool for its multipath next hops
+ *
+ * Returns 1 for an event, 0 at the end of the trace and -1 if the trace
+ * is damaged.
+ */
+int
+sdn_trace_read(struct sdn_trace *t, struct sdn_trace_event *ev, linpool *lp)
+{
+  byte buf[SDN_TRACE_REC_SIZE], hop[SDN_TRACE_HOP_SIZE], *pos;
+  struct mpnh **nhp, *nh;
+  size_t len;
+  int i;
+
+  len = fread(buf, 1, sizeof(buf), t->f);
+  if (!len)
+    return ferror(t->f) ? -1 : 0;
+  if (len < sizeof(buf))
+    return -1;
+
+  ev->delay = get_u32(buf);
+  ev->table = get_u32(buf + 4);
+  pos = sdn_trace_get_ip(buf + 8, &ev->prefix);
+  pos = sdn_trace_get_ip(pos, &ev->gw);
+  ev->pxlen = pos[0];
+  ev->dest = pos[1];
+  if (ev->pxlen > BITS_PER_IP_ADDRESS)
+    return -1;
+
+  nhp = &ev->nexthops;
+  for (i = pos[2]; i > 0; i--)
+    {
+      if (fread(hop, sizeof(hop), 1, t->f) != 1)
+	return -1;
+      nh = lp_allocz(lp, sizeof(struct mpnh));
+      sdn_trace_get_ip(hop, &nh->gw);
+      nh->weight = hop[sizeof(ip_addr)];
+      *nhp = nh;
+      nhp = &nh->next;
+    }
+  *nhp = NULL;
+  return 1;
+}
@@ -0,0 +1,168 @@
+/*
+ *	BIRD -- SDN Timing Wheel
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Timing wheel
+ *
+ * The SDN protocol has to age objects it owns (routes injected by the
+ * controller, for example) without walking all of them every second.
+ * It keeps them on a hierarchical timing wheel: level @l has
+ * %SDN_WHEEL_SLOTS slots, each %SDN_WHEEL_SLOTS^@l seconds wide. An
+ * object is hung on the lowest level whose span covers its expiry time
+ * and is cascaded to lower levels as the time approaches, so adding,
+ * rescheduling and removing an object is O(1) and each expiry costs at
+ * most %SDN_WHEEL_LEVELS list moves.
+ *
+ * The wheel only links &node structures; the user tells it how to find
+ * an expiry time of a node (needed when cascading) and what to do when
+ * it expires. The expire hook must either remove the node from the
+ * wheel or reschedule it.
+ */
+
+#include "nest/bird.h"
+#include "lib/lists.h"
+#include "lib/timer.h"
+
+#include "sdn.h"
+
+#define SDN_WHEEL_MASK	(SDN_WHEEL_SLOTS - 1)
+#define SDN_WHEEL_SPAN	((bird_clock_t) 1 << (SDN_WHEEL_LEVELS * SDN_WHEEL_BITS))
+
+static void
+sdn_wheel_insert(struct sdn_wheel *w, node *n, bird_clock_t when)
+{
+  bird_clock_t delta;
+  int l;
+
+  if (when < w->base)
+    when = w->base;
+  delta = when - w->base;
+  if (delta >= SDN_WHEEL_SPAN)
+    when = w->base + SDN_WHEEL_SPAN - 1, delta = SDN_WHEEL_SPAN - 1;
+
+  for (l = 0; delta >= ((bird_clock_t) 1 << ((l + 1) * SDN_WHEEL_BITS)); l++)
+    ;
+  add_tail(&w->slot[l][(when >> (l * SDN_WHEEL_BITS)) & SDN_WHEEL_MASK], n);
+}
+
+/**
+ * sdn_wheel_init - initialize a timing wheel
+ * @w: the wheel
+ * @base: current time
+ *
+ * The @expires and @expire hooks and @data are to be filled in by the caller.
+ */
+void
+sdn_wheel_init(struct sdn_wheel *w, bird_clock_t base)
+{
+  int l, i;
+
+  for (l = 0; l < SDN_WHEEL_LEVELS; l++)
+    for (i = 0; i < SDN_WHEEL_SLOTS; i++)
+      init_list(&w->slot[l][i]);
+  w->base = base;
+  w->count = 0;
+}
+
+/**
+ * sdn_wheel_add - schedule a node
+ * @w: the wheel
+ * @n: node not linked anywhere
+ * @when: expiry time
+ */
+void
+sdn_wheel_add(struct sdn_wheel *w, node *n, bird_clock_t when)
+{
+  sdn_wheel_insert(w, n, when);
+  w->count++;
+}
+
+/**
+ * sdn_wheel_update - reschedule a node already on the wheel
+ * @w: the wheel
+ * @n: node
+ * @when: new expiry time
+ */
+void
+sdn_wheel_update(struct sdn_wheel *w, node *n, bird_clock_t when)
+{
+  rem_node(n);
+  sdn_wheel_insert(w, n, when);
+}
+
+/**
+ * sdn_wheel_remove - take a node off the wheel
+ * @w: the wheel
+ * @n: node
+ */
+void
+sdn_wheel_remove(struct sdn_wheel *w, node *n)
+{
+  rem_node(n);
+  w->count--;
+}
+
+static void
+sdn_wheel_cascade(struct sdn_wheel *w, list *l)
+{
+  list tmp;
+  node *n, *nxt;
+
+  init_list(&tmp);
+  add_tail_list(&tmp, l);
+  init_list(l);
+
+  WALK_LIST_DELSAFE(n, nxt, tmp)
+    sdn_wheel_insert(w, n, w->expires(w, n));
+}
+
+/**
+ * sdn_wheel_advance - run expired nodes
+ * @w: the wheel
+ * @to: current time
+ *
+ * Calls the expire hook for every node due at or before @to.
+ */
+void
+sdn_wheel_advance(struct sdn_wheel *w, bird_clock_t to)
+{
+  list expired;
+  node *n;
+  int l, idx;
+
+  if (!w->count)
+    {
+      w->base = MAX(w->base, to + 1);
+      return;
+    }
+
+  while (w->base <= to)
+    {
+      idx = w->base & SDN_WHEEL_MASK;
+      for (l = 1; !idx && (l < SDN_WHEEL_LEVELS); l++)
+	{
+	  idx = (w->base >> (l * SDN_WHEEL_BITS)) & SDN_WHEEL_MASK;
+	  sdn_wheel_cascade(w, &w->slot[l][idx]);
+	}
+
+      idx = w->base++ & SDN_WHEEL_MASK;
+      if (EMPTY_LIST(w->slot[0][idx]))
+	continue;
+
+      init_list(&expired);
+      add_tail_list(&expired, &w->slot[0][idx]);
+      init_list(&w->slot[0][idx]);
+
+      WALK_LIST_FIRST(n, expired)
+	{
+	  w->expire(w, n);
+
+	  /* The hook has neither removed nor rescheduled it */
+	  if (n == HEAD(expired))
+	    sdn_wheel_remove(w, n);
+	}
+    }
+}